@@ -1,20 +1,23 @@
 //
 // $ cc simd_parse_time.c -Wall -Wextra -fsanitize=address,undefined -march=native -fopenmp -ggdb -O0
+// $ cc simd_parse_time.c -DTEST_ALL -march=native -fopenmp -O2 && ./a.out   # every day of 0001-9999, every second of 1970-2106
 //
 
+#define _GNU_SOURCE // strptime, timegm
 #include <stdint.h>
 #include <assert.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include <x86intrin.h>
 
 struct sse_parsed_time {
   char *error;
-  uint32_t time; // Unix time
+  int64_t time; // Unix time
 
-  uint32_t year;                // [0-9999]
+  uint32_t year;                // [1-9999]
   uint32_t month;               // [0-11]
   uint32_t mday;                // [1-31]
   uint32_t hour;                // [0-23]
@@ -22,21 +25,35 @@ struct sse_parsed_time {
   uint32_t second;              // [0-59]
 };
 
-static const uint32_t mdays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
-static const uint32_t mdays_cumulative[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334, 365};
-static inline uint64_t is_leap_year(uint32_t year) {
+// Indexed by [leap year][month & 15], months 12-15 are zero so that an invalid
+// month (including 00, which wraps to 0xFFFFFFFF) fails the day check.
+static const uint8_t mdays[2][16] = {
+  {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
+  {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31},
+};
+static const uint16_t mdays_cumulative[2][16] = {
+  {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334},
+  {0, 31, 60, 91, 121, 152, 182, 213, 244, 274, 305, 335},
+};
+
+static inline uint32_t is_leap_year(uint32_t year) {
   return (year % 4 == 0) & ((year % 100 != 0) | (year % 400 == 0));
 }
 
-static inline int leap_days(int y1, int y2) {
-  --y1;
-  --y2;
-  return (y2 / 4 - y1 / 4) - (y2 / 100 - y1 / 100) + (y2 / 400 - y1 / 400);
+// Days since 1970-01-01 of the proleptic Gregorian date. year in [1-9999],
+// month in [0-11]. No branches, year 1 keeps every division non-negative.
+static inline int64_t days_from_civil(uint32_t year, uint32_t month, uint32_t mday) {
+  uint32_t y = year - 1;
+  int64_t days = (int64_t)(365 * y + y / 4 - y / 100 + y / 400);
+  days += mdays_cumulative[is_leap_year(year)][month & 15];
+  days += mday - 1;
+  return days - 719162; // 0001-01-01 .. 1970-01-01
 }
 
-static struct sse_parsed_time sse_parse_time(char str[static 16])
+// Digit stage shared by every layout: `v` holds the 14 ASCII digits of
+// %Y%m%d%H%M%S in bytes 0-13. Checks digit ranges and month lengths.
+static struct sse_parsed_time sse_parse_digits(__m128i v)
 {
-  __m128i v = _mm_loadu_si128((const __m128i *)str);
   v = _mm_sub_epi8(v, _mm_set1_epi8('0'));
 
   __m128i limit = _mm_setr_epi8(9, 9, 9, 9, // year
@@ -66,75 +83,479 @@ static struct sse_parsed_time sse_parse_time(char str[static 16])
                                    -1);
   __m128i abide_by_limits16 = _mm_subs_epu16(v, limit16); // must be zero
 
-  __m128i limits = _mm_or_si128(abide_by_limits, abide_by_limits16);
-  if (!_mm_test_all_zeros(limits, limits)) {
-    return (struct sse_parsed_time) { .error = "Date not valid.", };
-  }
-
   uint64_t hi = (uint64_t)_mm_extract_epi64(v, 1);
   uint64_t lo = (uint64_t)_mm_extract_epi64(v, 0);
 
   uint32_t yr = ((lo >> 0)  & 0xFF) * 100 +
                 ((lo >> 16) & 0xFF) * 1;
-  uint32_t mo = ((lo >> 32)  & 0xFF) - 1;
+  uint32_t mo = ((lo >> 32)  & 0xFF) - 1;  // wraps for month 00, fails the table lookup
   uint32_t mday = (lo >> 48)  & 0xFF;
   uint32_t hour   = (hi >> 0) & 0xFF;
   uint32_t minute = (hi >> 16) & 0xFF;
   uint32_t second = (hi >> 32) & 0xFF;
 
-  if (yr < 1970) {
-    return (struct sse_parsed_time) {
-      .error = "Year less than 1970.",
-      .year = yr,
-      .month = mo,
-      .mday = mday,
-      .hour = hour,
-      .minute = minute,
-      .second = second,
-    };
+  // Digit limits, year 0000 and days outside the month in one test
+  __m128i limits = _mm_or_si128(abide_by_limits, abide_by_limits16);
+  uint32_t dim = mdays[is_leap_year(yr)][mo & 15];
+  _Bool ok = _mm_test_all_zeros(limits, limits) & (yr != 0) & (mday - 1 < dim);
+  if (!ok) {
+    return (struct sse_parsed_time) { .error = "Date not valid.", };
   }
 
-  _Bool leap_yr = (_Bool)is_leap_year(yr);
+  return (struct sse_parsed_time) {
+    .year = yr,   .month  = mo,     .mday   = mday,
+    .hour = hour, .minute = minute, .second = second,
+  };
+}
 
-  if (mday > mdays[mo]) {
-    if (mo == 1 && leap_yr) {
-      if (mday != 29) {
-        return (struct sse_parsed_time) { .error = "More days than valid in month.", };
-      }
+static struct sse_parsed_time sse_parse_time(char str[static 16])
+{
+  struct sse_parsed_time t = sse_parse_digits(_mm_loadu_si128((const __m128i *)str));
+  int64_t time = days_from_civil(t.year, t.month, t.mday) * 86400 +
+                 t.hour * 3600 + t.minute * 60 + t.second;
+  t.time = t.error ? 0 : time;
+  return t;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ISO-8601 / RFC 3339
+
+struct iso_parsed_time {
+  char *error;
+  int64_t time_ns; // Unix time in nanoseconds
+  size_t len;      // Bytes consumed
+};
+
+// Parses YYYY-MM-DD[Tt ]HH:MM:SS[.f+][Z|z|+hh:mm|-hh:mm]. A missing offset
+// means UTC. Digits past nanosecond precision are consumed and truncated.
+// Trailing bytes after the timestamp are left to the caller, see `len`.
+static struct iso_parsed_time sse_parse_iso8601(const char *str, size_t len)
+{
+  if (len < 19) {
+    return (struct iso_parsed_time) { .error = "Too short for YYYY-MM-DDTHH:MM:SS.", };
+  }
+
+  // Bytes 0-15 and 3-18 cover the 19 byte fixed part
+  __m128i v0 = _mm_loadu_si128((const __m128i *)(str + 0));
+  __m128i v1 = _mm_loadu_si128((const __m128i *)(str + 3));
+
+  __m128i sep = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 0, 0, 0, ':', 0, 0);
+  uint32_t sep0 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v0, sep));
+  uint32_t sep1 = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v1, sep));
+  _Bool t_sep = (str[10] | 0x20) == 't' || str[10] == ' ';
+  if ((sep0 & 0x2090) != 0x2090 || !(sep1 & 0x2000) || !t_sep) {
+    return (struct iso_parsed_time) { .error = "Separators not valid.", };
+  }
+
+  // Gather digits into the %Y%m%d%H%M%S layout
+  __m128i digits = _mm_or_si128(
+    _mm_shuffle_epi8(v0, _mm_setr_epi8(0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, -1, -1, -1, -1)),
+    _mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 14, 15, -1, -1)));
+  struct sse_parsed_time t = sse_parse_digits(digits);
+  if (t.error) {
+    return (struct iso_parsed_time) { .error = t.error, };
+  }
+
+  const char *at  = str + 19;
+  const char *end = str + len;
+
+  int64_t frac_ns = 0;
+  if (at < end && *at == '.') {
+    at++;
+
+    char pad[16];
+    const char *src = at;
+    if (end - at < 16) {
+      __builtin_memset(pad, 0, sizeof(pad));
+      __builtin_memcpy(pad, at, (size_t)(end - at));
+      src = pad;
     }
-    else {
-      return (struct sse_parsed_time) { .error = "More days than valid in month.", };
+
+    __m128i f = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)src), _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_subs_epu8(f, _mm_set1_epi8(9)), _mm_setzero_si128());
+    uint32_t digit_mask = (uint32_t)_mm_movemask_epi8(is_digit);
+    int n_digits = __builtin_ctz(~digit_mask); // Leading run of digits, 16 if all are
+    if (n_digits == 0) {
+      return (struct iso_parsed_time) { .error = "Fraction has no digits.", };
     }
+
+    // Zero everything past the ninth digit (or the first non-digit)
+    int n_keep = n_digits < 9 ? n_digits : 9;
+    __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    f = _mm_and_si128(f, _mm_cmpgt_epi8(_mm_set1_epi8((char)n_keep), iota));
+
+    __m128i pairs = _mm_maddubs_epi16(f, _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 0, 0, 0, 0, 0, 0, 0, 0));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 100, 1, 0, 0, 0, 0));
+    int64_t first8 = (int64_t)_mm_extract_epi32(quads, 0) * 10000 + _mm_extract_epi32(quads, 1);
+    frac_ns = first8 * 10 + _mm_extract_epi8(f, 8);
+
+    at += n_digits;
+    for (; at < end && *at >= '0' && *at <= '9'; at++);
   }
 
-  assert(yr >= 1970);
-  uint64_t days = 365 * (yr - 1970) + (uint64_t)leap_days(1970, yr);
-  days += mdays_cumulative[mo];
-  days += leap_yr & (mo > 1);
-  days += mday - 1;
+  int64_t offset_s = 0;
+  if (at < end && (*at | 0x20) == 'z') {
+    at++;
+  }
+  else if (at < end && (*at == '+' || *at == '-')) {
+    if (end - at < 6 || at[3] != ':') {
+      return (struct iso_parsed_time) { .error = "Offset not valid.", };
+    }
+    uint32_t d[4] = { at[1] - '0', at[2] - '0', at[4] - '0', at[5] - '0' };
+    if (d[0] > 9 || d[1] > 9 || d[2] > 5 || d[3] > 9) {
+      return (struct iso_parsed_time) { .error = "Offset not valid.", };
+    }
+    uint32_t off_hour = d[0] * 10 + d[1];
+    uint32_t off_min  = d[2] * 10 + d[3];
+    if (off_hour > 23) {
+      return (struct iso_parsed_time) { .error = "Offset not valid.", };
+    }
+    offset_s = (int64_t)(off_hour * 3600 + off_min * 60);
+    offset_s = *at == '-' ? -offset_s : offset_s;
+    at += 6;
+  }
 
-  uint64_t time64 = second +
-                    minute * 60 +
-                    hour   * 60 * 60 +
-                    days   * 60 * 60 * 24;
-  uint32_t time = (uint32_t)time64;
-  assert(time64 == time && "Overflow");
+  int64_t days = days_from_civil(t.year, t.month, t.mday);
+  int64_t secs = days * 86400 + t.hour * 3600 + t.minute * 60 + t.second - offset_s;
 
-  return (struct sse_parsed_time) {
-    .time = time,
-    .year = yr,   .month  = mo,     .mday   = mday,
-    .hour = hour, .minute = minute, .second = second,
-  };
+  int64_t time_ns;
+  if (__builtin_mul_overflow(secs, (int64_t)1000000000, &time_ns) ||
+      __builtin_add_overflow(time_ns, frac_ns, &time_ns)) {
+    return (struct iso_parsed_time) { .error = "Time does not fit in 64-bit nanoseconds.", };
+  }
+
+  return (struct iso_parsed_time) { .time_ns = time_ns, .len = (size_t)(at - str), };
+}
+
+#ifndef TEST_ALL // only the default program uses the batch parser
+// Parses `count` fixed-width %Y%m%d%H%M%S records placed `stride` bytes
+// apart. 16 bytes must be readable from the start of every record. Bit i of
+// the `valid` bitmap is set when times[i] holds the parsed Unix time, records
+// that fail to parse (or don't fit in uint32_t) get time 0 and a cleared bit.
+//
+// Two records share a 256-bit register during the digit stage, then four such
+// registers are transposed so that the calendar math runs on 8 records at once.
+static void avx2_parse_time_batch(const char *records, size_t stride, size_t count,
+                                  uint32_t *times, uint8_t *valid)
+{
+  const __m256i ascii_zero = _mm256_set1_epi8('0');
+  const __m256i limit = _mm256_setr_epi8(9, 9, 9, 9, 1, 9, 3, 9, 2, 9, 5, 9, 5, 9, -1, -1,
+                                         9, 9, 9, 9, 1, 9, 3, 9, 2, 9, 5, 9, 5, 9, -1, -1);
+  const __m256i weights = _mm256_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 0, 0,
+                                           10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 0, 0);
+  const __m256i limit16 = _mm256_setr_epi16(99, 99, 12, 31, 23, 59, 59, -1,
+                                            99, 99, 12, 31, 23, 59, 59, -1);
+  // Pairs of 16-bit fields -> [year, month*32 + mday, hour*3600 + minute*60, second]
+  const __m256i weights16 = _mm256_setr_epi16(100, 1, 32, 1, 3600, 60, 1, 0,
+                                              100, 1, 32, 1, 3600, 60, 1, 0);
+  // Register lanes hold records [0 2 4 6 | 1 3 5 7] after the transpose
+  const __m256i unshuffle = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i two = _mm256_set1_epi32(2);
+  const __m256i three = _mm256_set1_epi32(3);
+  const __m256i zero = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i r[4];
+    uint32_t digits_ok = 0;
+    for (int k = 0; k < 4; k++) {
+      const char *lo = records + (i + 2*k + 0) * stride;
+      const char *hi = records + (i + 2*k + 1) * stride;
+      __m256i v = _mm256_loadu2_m128i((const __m128i *)hi, (const __m128i *)lo);
+      v = _mm256_sub_epi8(v, ascii_zero);
+      __m256i abide_by_limits = _mm256_subs_epu8(v, limit); // must be zero
+      v = _mm256_maddubs_epi16(v, weights);
+      __m256i abide_by_limits16 = _mm256_subs_epu16(v, limit16); // must be zero
+
+      __m256i limits = _mm256_or_si256(abide_by_limits, abide_by_limits16);
+      uint32_t zeros = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(limits, zero));
+      digits_ok |= (uint32_t)((zeros & 0xFFFF) == 0xFFFF) << (2*k + 0);
+      digits_ok |= (uint32_t)((zeros >> 16)    == 0xFFFF) << (2*k + 1);
+
+      r[k] = _mm256_madd_epi16(v, weights16);
+    }
+
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i yr     = _mm256_unpacklo_epi64(t0, t1);
+    __m256i mo_day = _mm256_unpackhi_epi64(t0, t1);
+    __m256i hm     = _mm256_unpacklo_epi64(t2, t3);
+    __m256i sec    = _mm256_unpackhi_epi64(t2, t3);
+
+    __m256i mo   = _mm256_srli_epi32(mo_day, 5);
+    __m256i mday = _mm256_and_si256(mo_day, _mm256_set1_epi32(31));
+
+    // yr/100 and yr/400 via multiply-shift, exact for yr <= 9999
+    __m256i yr_div100 = _mm256_srli_epi32(_mm256_mullo_epi32(yr, _mm256_set1_epi32(5243)), 19);
+    __m256i yr_div400 = _mm256_srli_epi32(yr_div100, 2);
+    __m256i yr_mod100 = _mm256_sub_epi32(yr, _mm256_mullo_epi32(yr_div100, _mm256_set1_epi32(100)));
+    __m256i yr_mod400 = _mm256_sub_epi32(yr, _mm256_mullo_epi32(yr_div400, _mm256_set1_epi32(400)));
+    __m256i leap_yr = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(yr, three), zero),
+                                       _mm256_or_si256(_mm256_xor_si256(_mm256_cmpeq_epi32(yr_mod100, zero),
+                                                                        _mm256_set1_epi32(-1)),
+                                                       _mm256_cmpeq_epi32(yr_mod400, zero)));
+
+    // Days in month: 28 + 2-bit excess per month packed into one constant
+    __m256i dim = _mm256_srlv_epi32(_mm256_set1_epi32(0x3bbeecc), _mm256_add_epi32(mo, mo));
+    dim = _mm256_add_epi32(_mm256_and_si256(dim, three), _mm256_set1_epi32(28));
+    dim = _mm256_sub_epi32(dim, _mm256_and_si256(leap_yr, _mm256_cmpeq_epi32(mo, two))); // -(-1)
+
+    __m256i ok = _mm256_cmpgt_epi32(yr, _mm256_set1_epi32(1969));
+    ok = _mm256_and_si256(ok, _mm256_cmpgt_epi32(mo, zero));
+    ok = _mm256_and_si256(ok, _mm256_cmpgt_epi32(mday, zero));
+    ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(mday, dim), ok);
+
+    // Days from civil, counting years from March so that the leap day is last
+    __m256i jan_feb = _mm256_cmpgt_epi32(three, mo);
+    __m256i y  = _mm256_add_epi32(yr, jan_feb); // -(-1)
+    __m256i mp = _mm256_add_epi32(mo, _mm256_blendv_epi8(_mm256_set1_epi32(-3), _mm256_set1_epi32(9), jan_feb));
+    __m256i y_div100 = _mm256_srli_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32(5243)), 19);
+    __m256i doy = _mm256_add_epi32(_mm256_mullo_epi32(mp, _mm256_set1_epi32(153)), two);
+    doy = _mm256_srli_epi32(_mm256_mullo_epi32(doy, _mm256_set1_epi32(52429)), 18); // /5
+    doy = _mm256_add_epi32(doy, _mm256_sub_epi32(mday, one));
+    __m256i days = _mm256_mullo_epi32(y, _mm256_set1_epi32(365));
+    days = _mm256_add_epi32(days, _mm256_srli_epi32(y, 2));
+    days = _mm256_sub_epi32(days, y_div100);
+    days = _mm256_add_epi32(days, _mm256_srli_epi32(y_div100, 2));
+    days = _mm256_add_epi32(days, doy);
+    days = _mm256_sub_epi32(days, _mm256_set1_epi32(719468));
+
+    // Last representable second is 2106-02-07 06:28:15, day 49710 second 23295
+    __m256i sod = _mm256_add_epi32(hm, sec);
+    __m256i fits = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(49710), days),
+                                   _mm256_and_si256(_mm256_cmpeq_epi32(days, _mm256_set1_epi32(49710)),
+                                                    _mm256_cmpgt_epi32(_mm256_set1_epi32(23296), sod)));
+    ok = _mm256_and_si256(ok, fits);
+
+    __m256i time = _mm256_add_epi32(_mm256_mullo_epi32(days, _mm256_set1_epi32(86400)), sod);
+    time = _mm256_and_si256(time, ok);
+
+    time = _mm256_permutevar8x32_epi32(time, unshuffle);
+    ok   = _mm256_permutevar8x32_epi32(ok, unshuffle);
+    _mm256_storeu_si256((__m256i *)(times + i), time);
+    valid[i / 8] = (uint8_t)(digits_ok & (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(ok)));
+  }
+
+  for (; i < count; i++) {
+    if (i % 8 == 0) { valid[i / 8] = 0; }
+    struct sse_parsed_time t = sse_parse_time((char *)records + i * stride);
+    _Bool ok = !t.error && t.time >= 0 && t.time <= UINT32_MAX;
+    times[i] = ok ? (uint32_t)t.time : 0;
+    valid[i / 8] |= (uint8_t)(ok << (i % 8));
+  }
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Formatting
+
+struct civil_time {
+  uint32_t year;                // [1-9999]
+  uint32_t month;               // [1-12]
+  uint32_t mday;                // [1-31]
+  uint32_t sod;                 // [0-86399] second of day
+};
+
+// Inverse of days_from_civil, straight-line for years 1-9999 where the shifted
+// day count stays positive.
+static inline struct civil_time civil_from_time(int64_t time) {
+  int64_t days = time / 86400;
+  int64_t sod  = time % 86400;
+  int64_t borrow = sod >> 63; // floor division for times before 1970
+  days += borrow;
+  sod  += borrow & 86400;
+
+  uint32_t z   = (uint32_t)(days + 719468); // days since 0000-03-01
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;                                   // [0, 146096]
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);            // [0, 365]
+  uint32_t mp  = (5 * doy + 2) / 153;                                // [0, 11] from March
+  uint32_t mday  = doy - (153 * mp + 2) / 5 + 1;
+  uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+  uint32_t year  = yoe + era * 400 + (month <= 2);
+
+  return (struct civil_time) { year, month, mday, (uint32_t)sod };
+}
+
+// Each 16-bit lane holds a value in [0, 99], returns it as two ASCII digits.
+static inline __m128i sse_two_digits(__m128i v) {
+  __m128i tens = _mm_mulhi_epu16(v, _mm_set1_epi16(6554)); // v / 10, exact below 100
+  __m128i ones = _mm_sub_epi16(v, _mm_mullo_epi16(tens, _mm_set1_epi16(10)));
+  return _mm_add_epi8(_mm_or_si128(tens, _mm_slli_epi16(ones, 8)), _mm_set1_epi8('0'));
+}
+
+static inline __m256i avx2_two_digits(__m256i v) {
+  __m256i tens = _mm256_mulhi_epu16(v, _mm256_set1_epi16(6554));
+  __m256i ones = _mm256_sub_epi16(v, _mm256_mullo_epi16(tens, _mm256_set1_epi16(10)));
+  return _mm256_add_epi8(_mm256_or_si256(tens, _mm256_slli_epi16(ones, 8)), _mm256_set1_epi8('0'));
+}
+
+static inline __m128i civil_pairs(struct civil_time c) {
+  uint32_t hour   = c.sod / 3600;
+  uint32_t minute = c.sod / 60 - hour * 60;
+  uint32_t second = c.sod - (hour * 3600 + minute * 60);
+  return _mm_setr_epi16((short)(c.year / 100), (short)(c.year % 100), (short)c.month, (short)c.mday,
+                        (short)hour, (short)minute, (short)second, 0);
+}
+
+// Writes %Y%m%d%H%M%S followed by two NUL bytes. time must fall in years 1-9999.
+static void format_time(char buffer[static 16], int64_t time)
+{
+  __m128i digits = sse_two_digits(civil_pairs(civil_from_time(time)));
+  digits = _mm_and_si128(digits, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0));
+  _mm_storeu_si128((__m128i *)buffer, digits);
+}
+
+static inline __m128i iso8601_head(__m128i digits) {
+  // YYYYMMDDHHMMSS.. -> YYYY-MM-DDTHH:MM, seconds go in the tail
+  __m128i head = _mm_shuffle_epi8(digits, _mm_setr_epi8(0, 1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10, 11));
+  return _mm_or_si128(head, _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 'T', 0, 0, ':', 0, 0));
+}
+
+// Writes YYYY-MM-DDTHH:MM:SSZ, returns the length (20).
+static int format_time_iso8601(char buffer[static 20], int64_t time)
+{
+  __m128i digits = sse_two_digits(civil_pairs(civil_from_time(time)));
+  _mm_storeu_si128((__m128i *)buffer, iso8601_head(digits));
+  uint16_t ss = (uint16_t)_mm_extract_epi16(digits, 6);
+  buffer[16] = ':';
+  __builtin_memcpy(buffer + 17, &ss, 2);
+  buffer[19] = 'Z';
+  return 20;
+}
+
+// Writes YYYY-MM-DDTHH:MM:SS.nnnnnnnnnZ, returns the length (30).
+static int format_time_iso8601_ns(char buffer[static 30], int64_t time_ns)
+{
+  int64_t time = time_ns / 1000000000;
+  int64_t ns   = time_ns % 1000000000;
+  int64_t borrow = ns >> 63;
+  time += borrow;
+  ns   += borrow & 1000000000;
+
+  __m128i digits = sse_two_digits(civil_pairs(civil_from_time(time)));
+  _mm_storeu_si128((__m128i *)buffer, iso8601_head(digits));
+
+  uint32_t n = (uint32_t)ns;
+  __m128i frac = sse_two_digits(_mm_setr_epi16((short)(n / 10000000), (short)(n / 100000 % 100),
+                                               (short)(n / 1000 % 100),  (short)(n / 10 % 100),
+                                               (short)(n % 10 * 10), 0, 0, 0));
+  // :SS.nnnnnnnnnZ
+  __m128i tail = _mm_or_si128(
+    _mm_shuffle_epi8(digits, _mm_setr_epi8(-1, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+    _mm_shuffle_epi8(frac,   _mm_setr_epi8(-1, -1, -1, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, -1, -1, -1)));
+  tail = _mm_or_si128(tail, _mm_setr_epi8(':', 0, 0, '.', 0, 0, 0, 0, 0, 0, 0, 0, 0, 'Z', 0, 0));
+  char tmp[16];
+  _mm_storeu_si128((__m128i *)tmp, tail);
+  __builtin_memcpy(buffer + 16, tmp, 14);
+  return 30;
+}
+
+// x / d in every 32-bit lane, exact for x < 2^22: multiplies by the rounded
+// up reciprocal 2^s / d in the even and odd lanes separately.
+static inline __m256i avx2_div_u22(__m256i x, uint32_t d) {
+  int s = 22 + 32 - __builtin_clz(d - 1); // 22 + ceil(log2(d)), so x * error < 2^s
+  __m128i shift = _mm_cvtsi32_si128(s);
+  __m256i m = _mm256_set1_epi64x((int64_t)(((1ull << s) + d - 1) / d));
+  __m256i even = _mm256_srl_epi64(_mm256_mul_epu32(x, m), shift);
+  __m256i odd  = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), m), shift);
+  return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+static inline __m256i avx2_mul_u32(__m256i x, uint32_t c) {
+  return _mm256_mullo_epi32(x, _mm256_set1_epi32((int)c));
 }
 
+// Formats `count` times as %Y%m%d%H%M%S records placed `stride` bytes apart.
+// Like avx2_parse_time_batch, 16 bytes must be writable at every record and
+// records are written in order so a stride of 14 packs them back to back.
+//
+// civil_from_time runs on 8 records at once. Only the split into days and
+// second of day stays scalar, where the 64-bit division by 86400 is a
+// multiply. In years 1-9999 every later quotient is below 2^22.
+static void avx2_format_time_batch(const int64_t *times, size_t count, char *records, size_t stride)
+{
+  const __m256i keep = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0,
+                                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i two = _mm256_set1_epi32(2);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint32_t shifted_days[8], sods[8];
+    for (int j = 0; j < 8; j++) {
+      int64_t days = times[i + j] / 86400;
+      int64_t sod  = times[i + j] % 86400;
+      int64_t borrow = sod >> 63;
+      shifted_days[j] = (uint32_t)(days + borrow + 719468); // days since 0000-03-01
+      sods[j] = (uint32_t)(sod + (borrow & 86400));
+    }
+    __m256i z   = _mm256_loadu_si256((const __m256i *)shifted_days);
+    __m256i sod = _mm256_loadu_si256((const __m256i *)sods);
+
+    __m256i era = avx2_div_u22(z, 146097);
+    __m256i doe = _mm256_sub_epi32(z, avx2_mul_u32(era, 146097));
+    __m256i yoe = _mm256_sub_epi32(doe, avx2_div_u22(doe, 1460));
+    yoe = _mm256_add_epi32(yoe, avx2_div_u22(doe, 36524));
+    yoe = avx2_div_u22(_mm256_sub_epi32(yoe, avx2_div_u22(doe, 146096)), 365);
+    __m256i doy = _mm256_add_epi32(avx2_mul_u32(yoe, 365), _mm256_srli_epi32(yoe, 2));
+    doy = _mm256_sub_epi32(doe, _mm256_sub_epi32(doy, avx2_div_u22(yoe, 100)));
+    __m256i mp = avx2_div_u22(_mm256_add_epi32(avx2_mul_u32(doy, 5), two), 153);
+    __m256i mday = _mm256_sub_epi32(doy, avx2_div_u22(_mm256_add_epi32(avx2_mul_u32(mp, 153), two), 5));
+    mday = _mm256_add_epi32(mday, one);
+    __m256i jan_feb = _mm256_cmpgt_epi32(mp, _mm256_set1_epi32(9)); // -1 when mp is 10 or 11
+    __m256i month = _mm256_sub_epi32(_mm256_add_epi32(mp, _mm256_set1_epi32(3)),
+                                     _mm256_and_si256(jan_feb, _mm256_set1_epi32(12)));
+    __m256i year = _mm256_add_epi32(yoe, avx2_mul_u32(era, 400));
+    year = _mm256_sub_epi32(year, jan_feb);
+
+    __m256i century = avx2_div_u22(year, 100);
+    __m256i yy      = _mm256_sub_epi32(year, avx2_mul_u32(century, 100));
+    __m256i minutes = avx2_div_u22(sod, 60);
+    __m256i hour    = avx2_div_u22(sod, 3600);
+    __m256i minute  = _mm256_sub_epi32(minutes, avx2_mul_u32(hour, 60));
+    __m256i second  = _mm256_sub_epi32(sod, avx2_mul_u32(minutes, 60));
+
+    // Two 16-bit fields per lane in civil_pairs order, then a 4x8 transpose
+    // leaves one record per 128-bit half: [0|4], [1|5], [2|6], [3|7]
+    __m256i w0 = _mm256_or_si256(century, _mm256_slli_epi32(yy, 16));
+    __m256i w1 = _mm256_or_si256(month, _mm256_slli_epi32(mday, 16));
+    __m256i w2 = _mm256_or_si256(hour, _mm256_slli_epi32(minute, 16));
+    __m256i w3 = second;
+    __m256i lo01 = _mm256_unpacklo_epi32(w0, w1), lo23 = _mm256_unpacklo_epi32(w2, w3);
+    __m256i hi01 = _mm256_unpackhi_epi32(w0, w1), hi23 = _mm256_unpackhi_epi32(w2, w3);
+    __m256i r[4] = {
+      _mm256_and_si256(avx2_two_digits(_mm256_unpacklo_epi64(lo01, lo23)), keep),
+      _mm256_and_si256(avx2_two_digits(_mm256_unpackhi_epi64(lo01, lo23)), keep),
+      _mm256_and_si256(avx2_two_digits(_mm256_unpacklo_epi64(hi01, hi23)), keep),
+      _mm256_and_si256(avx2_two_digits(_mm256_unpackhi_epi64(hi01, hi23)), keep),
+    };
+    for (int j = 0; j < 4; j++) {
+      _mm_storeu_si128((__m128i *)(records + (i + j) * stride), _mm256_castsi256_si128(r[j]));
+    }
+    for (int j = 0; j < 4; j++) {
+      _mm_storeu_si128((__m128i *)(records + (i + 4 + j) * stride), _mm256_extracti128_si256(r[j], 1));
+    }
+  }
+  for (; i < count; i++) {
+    format_time(records + i * stride, times[i]);
+  }
+}
 
-static void format_time(char buffer[static 16], time_t rawtime)
+#ifndef TEST_ALL
+// Reference implementation, years before 1000 aren't zero padded by %Y
+static void format_time_strftime(char buffer[static 16], time_t rawtime)
 {
   struct tm timeinfo;
   gmtime_r(&rawtime, &timeinfo);
   size_t len = strftime(buffer, 16, "%Y%m%d%H%M%S", &timeinfo);
   assert(len != 0);
 }
+#endif
 
 
 #ifdef TEST_ALL
@@ -143,28 +564,50 @@ static void format_time(char buffer[static 16], time_t rawtime)
 #define EXPECT(got, expected)                                           \
   if ((got) != (expected)) {                                            \
     printf("When parsing time %.*s: Got: %d, Expected: %d\n", (int)sizeof(buf), buf, (got), (expected)); \
-    _Pragma("omp atomic")                                               \
-      errors += 1;                                                      \
+    errors += 1;                                                        \
   }
 
-_Bool test_all_valid(void) {
+// Returns the number of mismatches against libc for this instant.
+static int check_time(time_t rawtime) {
   int errors = 0;
 
-  #pragma omp parallel for shared(errors)
-  for (time_t rawtime = 0; rawtime < UINT32_MAX - 1; rawtime += 1) {
+  struct tm utc_tm;
+  gmtime_r(&rawtime, &utc_tm);
+
+  { // Formatters against libc
+    char buf[16], libc_buf[64] = {0}; // room for any int fields, the compare catches them
+    format_time(buf, rawtime);
+    snprintf(libc_buf, sizeof(libc_buf), "%04d%02d%02d%02d%02d%02d",
+             utc_tm.tm_year + 1900, utc_tm.tm_mon + 1, utc_tm.tm_mday,
+             utc_tm.tm_hour, utc_tm.tm_min, utc_tm.tm_sec);
+    if (memcmp(buf, libc_buf, 16) != 0) {
+      printf("When formatting time %ld: Got: %.14s, Expected: %.14s\n", rawtime, buf, libc_buf);
+      errors += 1;
+    }
+
+    char iso[20], libc_iso[64];
+    format_time_iso8601(iso, rawtime);
+    snprintf(libc_iso, sizeof(libc_iso), "%04d-%02d-%02dT%02d:%02d:%02dZ",
+             utc_tm.tm_year + 1900, utc_tm.tm_mon + 1, utc_tm.tm_mday,
+             utc_tm.tm_hour, utc_tm.tm_min, utc_tm.tm_sec);
+    if (memcmp(iso, libc_iso, 20) != 0) {
+      printf("When formatting time %ld: Got: %.20s, Expected: %.20s\n", rawtime, iso, libc_iso);
+      errors += 1;
+    }
+  }
+
+  {
     char buf[16];
     format_time(buf, rawtime);
 
     struct sse_parsed_time t = sse_parse_time(buf);
     if (t.error) {
       fprintf(stderr, "Error parsing time %.*s: %s\n", 16, buf, t.error);
-      #pragma omp atomic
       errors += 1;
     }
     else {
       if (t.time != rawtime) {
-        printf("When parsing time %.*s: Got: %u, Expected: %lu\n", (int)sizeof(buf), buf, t.time, rawtime);
-        #pragma omp atomic
+        printf("When parsing time %.*s: Got: %ld, Expected: %ld\n", (int)sizeof(buf), buf, t.time, rawtime);
         errors += 1;
       }
 
@@ -185,6 +628,140 @@ _Bool test_all_valid(void) {
     }
   }
 
+  { // Same instant as ISO-8601 with a fraction and UTC offset derived from rawtime
+    uint64_t bits = (uint64_t)rawtime;
+    int frac_digits = (int)(bits % 10); // 0 means no fraction
+    int64_t frac = (int64_t)(bits * 7919 % 1000000000);
+    int64_t frac_scale = 1;
+    for (int i = 0; i < frac_digits; i++) { frac_scale *= 10; }
+    frac %= frac_scale;
+    int64_t frac_ns = frac * (1000000000 / frac_scale);
+
+    int offset_min = ((int)(bits % 97) - 48) * 15; // [-12:00, +12:00]
+    time_t wall = rawtime + offset_min * 60;
+    struct tm wall_tm;
+    gmtime_r(&wall, &wall_tm);
+    if (wall_tm.tm_year + 1900 < 1 || wall_tm.tm_year + 1900 > 9999) {
+      return errors;
+    }
+
+    char iso[48];
+    int len = snprintf(iso, sizeof(iso), "%04d-%02d-%02dT%02d:%02d:%02d",
+                       wall_tm.tm_year + 1900, wall_tm.tm_mon + 1, wall_tm.tm_mday,
+                       wall_tm.tm_hour, wall_tm.tm_min, wall_tm.tm_sec);
+    if (frac_digits) {
+      len += snprintf(iso + len, sizeof(iso) - len, ".%0*ld", frac_digits, (long)frac);
+    }
+    if (offset_min == 0 && bits % 2) {
+      len += snprintf(iso + len, sizeof(iso) - len, "Z");
+    }
+    else {
+      int abs_min = offset_min < 0 ? -offset_min : offset_min;
+      len += snprintf(iso + len, sizeof(iso) - len, "%c%02d:%02d",
+                      offset_min < 0 ? '-' : '+', abs_min / 60, abs_min % 60);
+    }
+
+    struct tm libc_tm = {0};
+    char *libc_end = strptime(iso, "%Y-%m-%dT%H:%M:%S", &libc_tm);
+    assert(libc_end);
+    int64_t expected;
+    _Bool overflow = __builtin_mul_overflow((int64_t)timegm(&libc_tm) - offset_min * 60,
+                                            (int64_t)1000000000, &expected) ||
+                     __builtin_add_overflow(expected, frac_ns, &expected);
+
+    struct iso_parsed_time it = sse_parse_iso8601(iso, (size_t)len);
+    _Bool ok = overflow ? it.error != 0
+                        : (!it.error && it.time_ns == expected && it.len == (size_t)len);
+    if (!ok) {
+      printf("When parsing time %s: Got: %ld (%s), Expected: %ld%s\n",
+             iso, it.time_ns, it.error ? it.error : "ok", expected, overflow ? " (overflow)" : "");
+      errors += 1;
+    }
+
+    if (!overflow) { // Nanosecond formatter round trip
+      char iso_ns[32] = {0};
+      int ns_len = format_time_iso8601_ns(iso_ns, expected);
+      struct iso_parsed_time rt = sse_parse_iso8601(iso_ns, (size_t)ns_len);
+      if (rt.error || rt.time_ns != expected) {
+        printf("When formatting time %ld: Got: %.30s, parsed back as %ld\n", expected, iso_ns, rt.time_ns);
+        errors += 1;
+      }
+    }
+  }
+
+  return errors;
+}
+
+// Every day of years 0001-9999 at two times of day, plus every second of a
+// leap day, against libc. Dates and times of day are independent in the
+// formatter and parser, so this covers both without checking every second of
+// every day. Each check is independent, so the loops split evenly over threads.
+_Bool test_all_valid(void) {
+  int64_t first_day = days_from_civil(1, 0, 1);
+  int64_t last_day  = days_from_civil(9999, 11, 31);
+  int64_t leap_day  = days_from_civil(2000, 1, 29);
+  int errors = 0;
+
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (int64_t day = first_day; day <= last_day; day++) {
+    errors += check_time((time_t)(day * 86400));
+    errors += check_time((time_t)(day * 86400 + (day * 7919 & 0x7FFFFFFF) % 86400));
+  }
+
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (int64_t second = 0; second < 86400; second++) {
+    errors += check_time((time_t)(leap_day * 86400 + second));
+  }
+
+  // The batch formatter has its own vector calendar math, so it gets the same
+  // days against format_time, 64 at a time
+  enum { BLOCK = 64 };
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (int64_t block = first_day; block <= last_day; block += BLOCK) {
+    int64_t times[BLOCK];
+    char records[BLOCK * 16 + 16];
+    size_t n = (size_t)(last_day - block + 1 < BLOCK ? last_day - block + 1 : BLOCK);
+    for (size_t j = 0; j < n; j++) {
+      int64_t day = block + (int64_t)j;
+      times[j] = day * 86400 + (day * 7919 & 0x7FFFFFFF) % 86400;
+    }
+    avx2_format_time_batch(times, n, records, 16);
+    for (size_t j = 0; j < n; j++) {
+      char one[16];
+      format_time(one, times[j]);
+      if (memcmp(one, records + j * 16, 14) != 0) {
+        printf("When batch formatting time %ld: Got: %.14s, Expected: %.14s\n", times[j], records + j * 16, one);
+        errors += 1;
+      }
+    }
+  }
+
+  printf("%d errors over %ld days (%d threads)\n", errors, last_day - first_day + 1, omp_get_max_threads());
+  return errors == 0;
+}
+
+// Every second of the old uint32_t range 1970-2106 through format_time and
+// back through sse_parse_time. Too many seconds for the libc comparison, so
+// the fields are checked against plain division instead.
+_Bool test_all_seconds(void) {
+  int errors = 0;
+
+  #pragma omp parallel for reduction(+:errors) schedule(static)
+  for (int64_t rawtime = 0; rawtime <= UINT32_MAX; rawtime++) {
+    char buf[16];
+    format_time(buf, rawtime);
+    struct sse_parsed_time t = sse_parse_time(buf);
+    uint32_t sod = (uint32_t)(rawtime % 86400);
+    if (t.error || t.time != rawtime ||
+        t.hour != sod / 3600 || t.minute != sod / 60 % 60 || t.second != sod % 60) {
+      if (errors++ < 8) {
+        printf("When round tripping time %ld: Got: %ld (%.14s, %s)\n",
+               rawtime, t.time, buf, t.error ? t.error : "ok");
+      }
+    }
+  }
+
+  printf("%d errors over %ld seconds (%d threads)\n", errors, (int64_t)UINT32_MAX + 1, omp_get_max_threads());
   return errors == 0;
 }
 
@@ -193,6 +770,7 @@ int main(int argc, char *argv[])
   (void)argc;
   (void)argv;
   _Bool ok = test_all_valid();
+  ok &= test_all_seconds();
   return ok ? 0 : 1;
 }
 
@@ -221,6 +799,143 @@ int main(int argc, char *argv[])
     if (t.error) {
       printf("%s\n", t.error);
     }
+    else {
+      char iso[20];
+      format_time_iso8601(iso, t.time);
+      printf("%.14s -> %ld -> %.20s\n", buf, t.time, iso);
+    }
+  }
+
+  { // ISO-8601 / RFC 3339
+    struct { char *str; char *error; int64_t time_ns; } cases[] = {
+      { "1970-01-01T00:00:00Z",                    0, 0 },
+      { "1969-12-31T23:59:59.5Z",                  0, -500000000 },
+      { "0001-01-01T00:00:00Z",                    "Time does not fit in 64-bit nanoseconds.", 0 },
+      { "2024-02-29T12:34:56.789+02:00",           0, 1709202896789000000 },
+      { "2024-01-01 00:00:00.123456789123-00:30",  0, 1704069000123456789 },
+      { "2262-04-11T23:47:16.854775807Z",          0, INT64_MAX },
+      { "2262-04-11T23:47:16.854775808Z",          "Time does not fit in 64-bit nanoseconds.", 0 },
+      { "2023-02-29T00:00:00Z",                    "Date not valid.", 0 },
+      { "2023-02-28T00:00:00.Z",                   "Fraction has no digits.", 0 },
+      { "2023-02-28T00:00:00+0100",                "Offset not valid.", 0 },
+      { "2023/02/28T00:00:00Z",                    "Separators not valid.", 0 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+      char buf[64] = {0}; // Parser may read past the string, up to byte 19
+      size_t len = strlen(cases[i].str);
+      memcpy(buf, cases[i].str, len);
+      struct iso_parsed_time t = sse_parse_iso8601(buf, len);
+      _Bool ok = cases[i].error ? (t.error && strcmp(t.error, cases[i].error) == 0)
+                                : (!t.error && t.time_ns == cases[i].time_ns && t.len == len);
+      if (!ok) {
+        printf("ISO-8601 mismatch for %s: got %ld (%s), expected %ld (%s)\n", cases[i].str,
+               t.time_ns, t.error ? t.error : "ok", cases[i].time_ns, cases[i].error ? cases[i].error : "ok");
+      }
+      if (!t.error) {
+        char iso[32] = {0};
+        int iso_len = format_time_iso8601_ns(iso, t.time_ns);
+        struct iso_parsed_time rt = sse_parse_iso8601(iso, (size_t)iso_len);
+        if (rt.error || rt.time_ns != t.time_ns) {
+          printf("ISO-8601 round trip mismatch for %s: formatted as %s\n", cases[i].str, iso);
+        }
+      }
+    }
+  }
+
+  { // Batch parser: check against scalar parser and compare throughput
+    enum { N = 1 << 20, STRIDE = 16 };
+    static char records[N * STRIDE];
+    static uint32_t times[N];
+    static uint8_t valid[(N + 7) / 8];
+
+    uint64_t rng = 1;
+    for (size_t i = 0; i < N; i++) {
+      rng = rng * 1111111111111111111u + 1;
+      time_t rawtime = (time_t)((rng >> 32) * 17 / 16); // ~6% land after 2106
+      format_time(records + i * STRIDE, rawtime);
+      if (i % 7 == 0) { // Corrupt a digit
+        records[i * STRIDE + (rng >> 60) % 14] = '0' + (char)((rng >> 56) % 10);
+      }
+    }
+
+    size_t n = N - 3; // exercise the scalar tail
+    avx2_parse_time_batch(records, STRIDE, n, times, valid);
+
+    size_t mismatches = 0, n_valid = 0;
+    for (size_t i = 0; i < n; i++) {
+      struct sse_parsed_time t = sse_parse_time(records + i * STRIDE);
+      _Bool expect_ok = !t.error && t.time >= 0 && t.time <= UINT32_MAX;
+      _Bool ok = (valid[i / 8] >> (i % 8)) & 1;
+      n_valid += ok;
+      if (ok != expect_ok || (ok && times[i] != t.time)) {
+        if (mismatches++ < 8) {
+          printf("Batch mismatch for %.14s: got %u (%d), expected %ld (%s)\n",
+                 records + i * STRIDE, times[i], ok, t.time, t.error ? t.error : "ok");
+        }
+      }
+    }
+    printf("Batch: %zu records, %zu valid, %zu mismatches\n", n, n_valid, mismatches);
+
+    struct timespec t0, t1, t2;
+    volatile int64_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < n; i++) {
+      sink += sse_parse_time(records + i * STRIDE).time;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    avx2_parse_time_batch(records, STRIDE, n, times, valid);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    double scalar_ns = (double)(t1.tv_sec - t0.tv_sec) * 1e9 + (double)(t1.tv_nsec - t0.tv_nsec);
+    double batch_ns  = (double)(t2.tv_sec - t1.tv_sec) * 1e9 + (double)(t2.tv_nsec - t1.tv_nsec);
+    printf("sse_parse_time:        %6.2f ns/record\n", scalar_ns / (double)n);
+    printf("avx2_parse_time_batch: %6.2f ns/record\n", batch_ns / (double)n);
+  }
+
+  { // Formatting: SIMD against strftime
+    enum { N = 1 << 20 };
+    static int64_t times[N];
+    static char records[N * 16 + 16], libc_records[N * 16];
+
+    uint64_t rng = 7;
+    for (size_t i = 0; i < N; i++) {
+      rng = rng * 1111111111111111111u + 1;
+      times[i] = (int64_t)(rng >> 32);
+      format_time_strftime(libc_records + i * 16, (time_t)times[i]);
+    }
+
+    size_t n = N - 1; // exercise the scalar tail
+    avx2_format_time_batch(times, n, records, 16);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < n; i++) {
+      char one[16];
+      format_time(one, times[i]);
+      if (memcmp(one, libc_records + i * 16, 14) != 0 || memcmp(records + i * 16, one, 14) != 0) {
+        if (mismatches++ < 8) {
+          printf("Format mismatch for %ld: %.14s %.14s, expected %.14s\n",
+                 times[i], one, records + i * 16, libc_records + i * 16);
+        }
+      }
+    }
+    printf("Format: %zu records, %zu mismatches\n", n, mismatches);
+
+    struct timespec t0, t1, t2, t3;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < n; i++) {
+      format_time_strftime(libc_records + i * 16, (time_t)times[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (size_t i = 0; i < n; i++) {
+      format_time(records + i * 16, times[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    avx2_format_time_batch(times, n, records, 14);
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    double libc_ns  = (double)(t1.tv_sec - t0.tv_sec) * 1e9 + (double)(t1.tv_nsec - t0.tv_nsec);
+    double sse_ns   = (double)(t2.tv_sec - t1.tv_sec) * 1e9 + (double)(t2.tv_nsec - t1.tv_nsec);
+    double batch_ns = (double)(t3.tv_sec - t2.tv_sec) * 1e9 + (double)(t3.tv_nsec - t2.tv_nsec);
+    printf("gmtime_r + strftime:    %6.2f ns/record\n", libc_ns  / (double)n);
+    printf("format_time:            %6.2f ns/record\n", sse_ns   / (double)n);
+    printf("avx2_format_time_batch: %6.2f ns/record\n", batch_ns / (double)n);
   }
 
   return 0;
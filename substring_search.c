@@ -1,6 +1,9 @@
 #if IN_SHELL /* $ bash substring_search.c
  # cc substring_search.c -o substring_search -fsanitize=undefined -g3 -Wall -Wextra -Wconversion -Wno-sign-conversion -march=native $@
  cc substring_search.c -o substring_search -O3 -march=native $@
+ # grep -F like front-end over mmap'd files:
+ # cc substring_search.c -o sgrep -O3 -march=native -DGREP $@
+ # time ./sgrep -t ERROR $LOGS | wc -l; time grep -F ERROR $LOGS | wc -l
 exit # */
 #endif
 
@@ -64,9 +67,10 @@ static ptrdiff_t search_avx2(const char *haystack, size_t haystack_len,
   __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
 
   size_t i = 0;
-  for (; needle_len <= 32 && i + 32 < haystack_len; i += 32) {
+  // Both loads must stay inside the haystack: callers may pass an mmap that
+  // ends on a page boundary.
+  for (; needle_len <= 32 && i + 32 + needle_len - 1 <= haystack_len; i += 32) {
     __m256i in_first = _mm256_loadu_si256((__m256i *)(haystack + i));
-    if (i + needle_len - 1 >= haystack_len) break;
     __m256i in_last = _mm256_loadu_si256((__m256i *)(haystack + i + needle_len - 1));
 
     __m256i hits_first = _mm256_cmpeq_epi8(first, in_first);
@@ -248,6 +252,161 @@ char *musl_strstr(const char *h, const char *n)
 ////////////////////////////////////////////////////////////////////////////////
 //- Program
 
+#if defined(GREP)
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Returns pointer to the first '\n' in [p, end) or end.
+static const char *scan_line_end(const char *p, const char *end) {
+  __m256i nl = _mm256_set1_epi8('\n');
+  for (; p + 32 <= end; p += 32) {
+    __m256i in = _mm256_loadu_si256((__m256i *)p);
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(in, nl));
+    if (mask) { return p + __builtin_ctz(mask); }
+  }
+  for (; p < end && *p != '\n'; p++);
+  return p;
+}
+
+// Returns the start of the line containing p, never going before beg.
+static const char *scan_line_beg(const char *beg, const char *p) {
+  __m256i nl = _mm256_set1_epi8('\n');
+  for (; p - 32 >= beg; p -= 32) {
+    __m256i in = _mm256_loadu_si256((__m256i *)(p - 32));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(in, nl));
+    if (mask) { return p - 32 + (31 - __builtin_clz(mask)) + 1; }
+  }
+  for (; p > beg && p[-1] != '\n'; p--);
+  return p;
+}
+
+static struct {
+  char buf[1 << 20];
+  intptr_t len;
+  _Bool error;
+} out;
+
+static void out_flush(void) {
+  for (intptr_t off = 0; !out.error && off < out.len;) {
+    ssize_t written = write(1, out.buf + off, out.len - off);
+    if (written < 1) { out.error = 1; }
+    off += written;
+  }
+  out.len = 0;
+}
+
+static void out_append(const char *src, intptr_t len) {
+  if (out.len + len > countof(out.buf)) {
+    out_flush();
+  }
+  if (len > countof(out.buf)) { // Huge line: bypass the buffer
+    for (intptr_t off = 0; !out.error && off < len;) {
+      ssize_t written = write(1, src + off, len - off);
+      if (written < 1) { out.error = 1; }
+      off += written;
+    }
+    return;
+  }
+  memcpy(out.buf + out.len, src, len);
+  out.len += len;
+}
+
+// Prints every line of [data, data + len) that contains needle. Returns
+// number of matching lines.
+static intptr_t grep_buffer(const char *file_name, const char *data, size_t len,
+                            const char *needle, size_t needle_len) {
+  intptr_t matches = 0;
+  const char *at = data;
+  const char *end = data + len;
+  while (at < end) {
+    ptrdiff_t off = search_avx2(at, end - at, needle, needle_len);
+    if (off < 0) break;
+
+    const char *line_beg = scan_line_beg(at, at + off);
+    const char *line_end = scan_line_end(at + off + needle_len, end);
+    if (file_name) {
+      out_append(file_name, strlen(file_name));
+      out_append(":", 1);
+    }
+    out_append(line_beg, line_end - line_beg);
+    out_append("\n", 1);
+    matches++;
+
+    at = line_end + 1;
+  }
+  return matches;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+  _Bool show_stats = argc > 1 && strcmp(argv[1], "-t") == 0;
+  argv += show_stats;
+  argc -= show_stats;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: sgrep [-t] PATTERN FILE...\n");
+    return 2;
+  }
+
+  const char *needle = argv[1];
+  size_t needle_len = strlen(needle);
+  if (needle_len == 0 || memchr(needle, '\n', needle_len)) {
+    fprintf(stderr, "sgrep: PATTERN must be a non-empty single line\n");
+    return 2;
+  }
+
+  int status = 1;
+  intptr_t total_bytes = 0;
+  double start_time = now_seconds();
+
+  for (int i = 2; i < argc; i++) {
+    const char *file_name = argc > 3 ? argv[i] : 0;
+
+    int fd = open(argv[i], O_RDONLY);
+    if (fd < 0) { perror(argv[i]); status = 2; continue; }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) { perror(argv[i]); close(fd); status = 2; continue; }
+    if (st.st_size == 0)    { close(fd); continue; }
+
+    char *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { perror(argv[i]); status = 2; continue; }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    intptr_t matches = grep_buffer(file_name, data, st.st_size, needle, needle_len);
+    if (matches && status == 1) { status = 0; }
+    total_bytes += st.st_size;
+
+    munmap(data, st.st_size);
+  }
+
+  out_flush();
+  if (out.error) { perror("write"); status = 2; }
+
+  if (show_stats) {
+    double elapsed = now_seconds() - start_time;
+    fprintf(stderr, "Scanned: %.2f MB\n", (double)total_bytes / (1024 * 1024));
+    fprintf(stderr, "Time: %.3f seconds\n", elapsed);
+    fprintf(stderr, "Throughput: %.2f GB/s\n", (total_bytes / (1024.0 * 1024.0 * 1024.0)) / elapsed);
+  }
+
+  return status;
+}
+
+#else // benchmark program
+
 static int64_t rdtscp(void) {
     uint64_t hi, lo;
     asm volatile ("rdtscp" : "=d"(hi), "=a"(lo) :: "cx", "memory");
@@ -375,3 +534,5 @@ int main() {
   
   return 0;
 }
+
+#endif
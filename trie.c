@@ -1,7 +1,15 @@
 // Platform: POSIX libc
 //
-// $ cc trie.c -o trie
-// $ ./trie   # requires dot and ffmpeg in path
+// $ cc trie.c -o trie -O2 -pthread
+// $ ./trie   # prints the trie as DOT
+// $ ./trie 32 # renders 32 inserts to trie.mkv, requires dot and ffmpeg in path
+// $ ./trie bench-mt [max_threads]
+// $ ./trie bench-hash
+// $ ./trie bench-compact
+// $ ./trie bench-persistent
+// $ ./trie bench-flat [keys]   # writes ./trie.bin
+// $ ./trie bench-bulk [keys] [threads]
+// $ for f in 4 8 16; do cc trie.c -o trie$f -O2 -pthread -DHASH_TRIE_FANOUT=$f && ./trie$f bench-fanout; done
 //
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -28,23 +36,38 @@ typedef __SIZE_TYPE__    usize;
 ////////////////////////////////////////////////////////////////////////////////
 //- Platform Agnostic Layer
 
-#define HEAP_CAPACITY (1<<28)
+// Large enough for bench-fanout at 10M keys. Reserved without committing swap
+// space, so pages are only backed as the arena touches them, except under
+// strict overcommit where the reservation itself may fail.
+#define HEAP_CAPACITY (1ll<<32)
 
 i32  os_open (char *file_path);
 i32  os_close(i32 fd);
 b32  os_write(i32 fd, u8 *buf, size len);
 b32  os_read (i32 fd, u8 *buf, size len);
 void os_exit (i32 status);
-i32  os_mkdir(char *file_path);
+u8  *os_reserve(size capacity); // zeroed, null on failure
 
+// `dot | ffmpeg`, every graph written to write_fd becomes one video frame
 typedef struct Pipe {
   i32 write_fd;
-  i32 pid;
+  i32 dot_pid;
+  i32 ffmpeg_pid;
 } Pipe;
 
-Pipe os_start_graphviz(char *out_file);
-b32  os_stop_graphviz(Pipe pipe);
-b32  os_ffmpeg(char *out_file);
+Pipe os_start_render(char *out_file);
+b32  os_stop_render(Pipe pipe);
+
+typedef struct Arena Arena;
+typedef struct Thread Thread;
+
+Thread *os_thread_start(Arena *perm, void (*entry)(void *), void *arg);
+b32     os_thread_join (Thread *thread);
+i32     os_cpu_count(void);
+i64     os_now_ns(void);
+
+b32  os_write_file(char *file_path, u8 *buf, size len);
+u8  *os_map_file  (char *file_path, size *len);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -55,12 +78,12 @@ b32  os_ffmpeg(char *out_file);
 #define new2(a, t)    (t *) arena_alloc(a, sizeof(t), alignof(t), 1)
 #define new3(a, t, n) (t *) arena_alloc(a, sizeof(t), alignof(t), (n))
 
-typedef struct {
+struct Arena {
   // REVIEW: We only need an *at and *end pointer
   u8 *backing;
   u8 *at;
   size capacity;
-} Arena;
+};
 
 Arena arena_init(u8 *backing, size capacity)
 {
@@ -103,13 +126,27 @@ typedef struct {
   size len;
 } Str;
 
+u64 load_u64(u8 *p)
+{
+  u64 r;
+  __builtin_memcpy(&r, p, 8);
+  return r;
+}
+
+// Compares 8 bytes at a time, the last word overlaps the previous one
 b32 str_equals(Str a, Str b)
 {
   if (a.len != b.len) { return 0; }
-  for (size i = 0; i < a.len; i++) {
-    if (a.buf[i] != b.buf[i]) { return 0; }
+  if (a.len < 8) {
+    for (size i = 0; i < a.len; i++) {
+      if (a.buf[i] != b.buf[i]) { return 0; }
+    }
+    return 1;
   }
-  return 1;
+  for (size i = 0; i < a.len - 8; i += 8) {
+    if (load_u64(a.buf + i) != load_u64(b.buf + i)) { return 0; }
+  }
+  return load_u64(a.buf + a.len - 8) == load_u64(b.buf + b.len - 8);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -320,40 +357,566 @@ void flush(Write_Buffer *b)
 ////////////////////////////////////////////////////////////////////////////////
 //- Hash Trie
 
+// Branching factor, each level consumes log2(HASH_TRIE_FANOUT) hash bits
+#ifndef HASH_TRIE_FANOUT
+#define HASH_TRIE_FANOUT 4
+#endif
+
+#if   HASH_TRIE_FANOUT == 4
+#define HASH_TRIE_BITS 2
+#elif HASH_TRIE_FANOUT == 8
+#define HASH_TRIE_BITS 3
+#elif HASH_TRIE_FANOUT == 16
+#define HASH_TRIE_BITS 4
+#else
+#error "HASH_TRIE_FANOUT must be 4, 8 or 16"
+#endif
+
+// Every node keeps its key's full hash, a mismatch along the path is then
+// rejected without touching the key bytes. A deleted node stays in place as
+// a tombstone, it still routes lookups to its children.
 typedef struct Hash_Map {
-  struct Hash_Map *child[4];
+  struct Hash_Map *child[HASH_TRIE_FANOUT];
   Str key;
   Str value;
+  u64 hash;
+  b32 deleted;
 } Hash_Map;
 
+// Multiply-xorshift over 8-byte words. The trie consumes the top bits first,
+// which the final multiply makes depend on every input byte.
 u64 hash_str(Str s)
 {
-  u64 h = 0x100;
-  for (size i = 0; i < s.len; i++) {
-    h ^= s.buf[i];
-    h *= 1111111111111111111u;
+  u64 h = 0x100 ^ (u64)s.len;
+  size i = 0;
+  for (; i + 8 <= s.len; i += 8) {
+    h = (h ^ load_u64(s.buf + i)) * 1111111111111111111u;
+    h ^= h >> 32;
   }
-  return h;
+  u64 tail = 0;
+  for (size j = 0; i + j < s.len; j++) {
+    tail |= (u64)s.buf[i + j] << (8 * j);
+  }
+  h = (h ^ tail) * 1111111111111111111u;
+  h ^= h >> 32;
+  return h * 1111111111111111111u;
+}
+
+b32 hash_map_matches(Hash_Map *m, u64 hash, Str key)
+{
+  return m->hash == hash && str_equals(key, m->key);
+}
+
+Hash_Map *hash_map_node(Arena *perm, u64 hash, Str key)
+{
+  Hash_Map *m = new(perm, Hash_Map);
+  m->key = key;
+  m->hash = hash;
+  return m;
 }
 
 Str *upsert(Arena *perm, Hash_Map **m, Str key)
 {
-  for (u64 h = hash_str(key); *m; h <<= 2) {
-    if (str_equals(key, (*m)->key)) {
+  u64 hash = hash_str(key);
+  for (u64 h = hash; *m; h <<= HASH_TRIE_BITS) {
+    if (hash_map_matches(*m, hash, key)) {
+      if ((*m)->deleted) {  // Inserting revives the tombstone
+        if (!perm) {
+          return 0;
+        }
+        (*m)->deleted = 0;
+      }
       return &(*m)->value;
     }
-    m = &(*m)->child[h >> 62];
+    m = &(*m)->child[h >> (64 - HASH_TRIE_BITS)];
   }
 
   if (!perm) {
     return 0;
   }
 
-  *m = new(perm, Hash_Map);
-  (*m)->key = key;
+  *m = hash_map_node(perm, hash, key);
+  return &(*m)->value;
+}
+
+// Thread-safe upsert: any number of threads may insert into the same trie,
+// each allocating from its own arena. An empty slot is claimed with a CAS;
+// the loser of a race continues from the winning node, so racing inserts of
+// the same key converge on one node. Access to the returned value is not
+// synchronized, and neither is hash_map_delete.
+Str *upsert_concurrent(Arena *perm, Hash_Map **m, Str key)
+{
+  Hash_Map *fresh = 0;
+  u64 hash = hash_str(key);
+  for (u64 h = hash;; h <<= HASH_TRIE_BITS) {
+    Hash_Map *n = __atomic_load_n(m, __ATOMIC_ACQUIRE);
+    if (!n) {
+      if (!perm) {
+        return 0;
+      }
+      if (!fresh) {  // Kept across lost races, reused for the next empty slot
+        fresh = hash_map_node(perm, hash, key);
+      }
+      if (__atomic_compare_exchange_n(m, &n, fresh, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        return &fresh->value;
+      }
+      // Lost the race, n is now the winner's node
+    }
+    if (hash_map_matches(n, hash, key)) {
+      if (__atomic_load_n(&n->deleted, __ATOMIC_RELAXED)) {
+        if (!perm) {
+          return 0;
+        }
+        __atomic_store_n(&n->deleted, 0, __ATOMIC_RELAXED);
+      }
+      return &n->value;
+    }
+    m = &n->child[h >> (64 - HASH_TRIE_BITS)];
+  }
+}
+
+// Path-copying upsert: *m is replaced by a new root and every node from the
+// root down to the key is copied into `perm`, the rest is shared with the
+// previous version, which stays valid and unchanged. A version lives as long
+// as its arena and the arenas of the versions it was derived from, so
+// checkpointing `perm` before the call and restoring it drops the version.
+// Publish the new root with a release store for readers on other threads.
+//
+// Nodes allocated in `perm` since `version_beg` belong to the unpublished
+// version and are updated in place, so a batch of inserts into one version
+// copies each shared node once. Pass perm->at from before the first insert
+// of the version, or 0 to copy the whole path every time.
+Str *upsert_persistent(Arena *perm, Hash_Map **m, Str key, u8 *version_beg)
+{
+  u64 hash = hash_str(key);
+  for (u64 h = hash; *m; h <<= HASH_TRIE_BITS) {
+    Hash_Map *copy = *m;
+    if (!version_beg || (u8 *)copy < version_beg || (u8 *)copy >= perm->at) {
+      copy = new(perm, Hash_Map);
+      *copy = **m;
+      *m = copy;
+    }
+    if (hash_map_matches(copy, hash, key)) {
+      copy->deleted = 0;
+      return &copy->value;
+    }
+    m = &copy->child[h >> (64 - HASH_TRIE_BITS)];
+  }
+
+  *m = hash_map_node(perm, hash, key);
   return &(*m)->value;
 }
 
+size hash_map_count(Hash_Map *m)
+{
+  if (!m) { return 0; }
+  size count = 1;
+  for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
+    count += hash_map_count(m->child[i]);
+  }
+  return count;
+}
+
+// Turns the key's node into a tombstone and clears its value. The memory is
+// only reclaimed by hash_map_compact. Returns 0 if the key wasn't present.
+b32 hash_map_delete(Hash_Map *m, Str key)
+{
+  u64 hash = hash_str(key);
+  for (u64 h = hash; m; h <<= HASH_TRIE_BITS) {
+    if (hash_map_matches(m, hash, key)) {
+      if (m->deleted) {
+        return 0;
+      }
+      m->deleted = 1;
+      m->value = (Str){0};
+      return 1;
+    }
+    m = m->child[h >> (64 - HASH_TRIE_BITS)];
+  }
+  return 0;
+}
+
+// Pre-order iteration without recursion. Popping a node pushes all of its
+// children, so the stack holds at most depth * (fanout - 1) + 1 entries; it
+// starts sized for the depth at which the hash bits run out and doubles
+// into the arena if full hash collisions go deeper.
+typedef struct Hash_Map_Iter {
+  Arena *arena;
+  Hash_Map **stack;
+  size len;
+  size cap;
+} Hash_Map_Iter;
+
+Hash_Map_Iter hash_map_iter(Arena *scratch, Hash_Map *m)
+{
+  Hash_Map_Iter it = {0};
+  it.arena = scratch;
+  it.cap   = (64 / HASH_TRIE_BITS + 1) * (HASH_TRIE_FANOUT - 1) + 1;
+  it.stack = new(scratch, Hash_Map *, it.cap);
+  if (m) {
+    it.stack[it.len++] = m;
+  }
+  return it;
+}
+
+// Returns the next live node, skipping tombstones, or 0 at the end
+Hash_Map *hash_map_next(Hash_Map_Iter *it)
+{
+  while (it->len) {
+    Hash_Map *m = it->stack[--it->len];
+    if (it->len + HASH_TRIE_FANOUT > it->cap) {
+      Hash_Map **grown = new(it->arena, Hash_Map *, it->cap * 2);
+      __builtin_memcpy(grown, it->stack, it->len * sizeof(*grown));
+      it->stack = grown;
+      it->cap  *= 2;
+    }
+    for (size i = HASH_TRIE_FANOUT - 1; i >= 0; i--) {  // Child 0 pops first
+      if (m->child[i]) {
+        it->stack[it->len++] = m->child[i];
+      }
+    }
+    if (!m->deleted) {
+      return m;
+    }
+  }
+  return 0;
+}
+
+// Rebuilds the live entries into `perm`, dropping tombstones. The old trie is
+// walked breadth-first and every node is inserted before its descendants, so
+// the new nodes land in one contiguous block in level order, followed by the
+// copied key bytes. Values are copied as slices, their bytes aren't moved.
+// The BFS queue lives in `scratch`, which must not overlap `perm`.
+Hash_Map *hash_map_compact(Arena *perm, Arena scratch, Hash_Map *m)
+{
+  size total = hash_map_count(m);
+  Hash_Map **queue = new(&scratch, Hash_Map *, total);
+  size head = 0, tail = 0;
+  size live = 0, key_bytes = 0;
+  if (m) {
+    queue[tail++] = m;
+  }
+  while (head < tail) {
+    Hash_Map *n = queue[head++];
+    for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
+      if (n->child[i]) {
+        queue[tail++] = n->child[i];
+      }
+    }
+    live      += !n->deleted;
+    key_bytes += n->deleted ? 0 : n->key.len;
+  }
+
+  Hash_Map *nodes = new(perm, Hash_Map, live);
+  u8 *keys = new(perm, u8, key_bytes);
+  Hash_Map *root = 0;
+  for (size q = 0, used = 0; q < total; q++) {
+    Hash_Map *n = queue[q];
+    if (n->deleted) {
+      continue;
+    }
+
+    // Live keys are distinct, so the walk only looks for an empty slot
+    Hash_Map **slot = &root;
+    for (u64 h = n->hash; *slot; h <<= HASH_TRIE_BITS) {
+      slot = &(*slot)->child[h >> (64 - HASH_TRIE_BITS)];
+    }
+
+    Hash_Map *c = *slot = &nodes[used++];
+    __builtin_memcpy(keys, n->key.buf, n->key.len);
+    c->key   = (Str){ .buf = keys, .len = n->key.len };
+    c->value = n->value;
+    c->hash  = n->hash;
+    keys += n->key.len;
+  }
+  return root;
+}
+
+
+// Bulk construction. Every subtree owns a contiguous range of the entries
+// and the same range of one node array: the range's first entry becomes the
+// subtree's node and the rest is scattered by the next hash digit into the
+// child ranges, ping-ponging between two entry buffers. The nodes come out
+// contiguous in depth-first order, with one allocation for all of them.
+typedef struct Bulk_Entry {
+  u64 hash;
+  size index;  // Into keys and values, -1 once merged into an earlier duplicate
+} Bulk_Entry;
+
+typedef struct Bulk_Job {
+  Hash_Map **slot;
+  Bulk_Entry *src;
+  Bulk_Entry *dst;
+  size lo;
+  size hi;
+  i32 shift;
+} Bulk_Job;
+
+typedef struct Bulk_Load {
+  Str *keys;
+  Str *values;
+  Hash_Map *nodes;
+  Bulk_Entry *entries;
+  size count;
+  i32 threads;
+  i32 job_shift;   // Subtrees at this depth are deferred to the workers
+  Bulk_Job *jobs;
+  size jobs_count;
+  size next;       // Next job or hash chunk, claimed atomically
+} Bulk_Load;
+
+u64 bulk_digit(u64 hash, i32 shift)
+{
+  return shift < 64 ? (hash << shift) >> (64 - HASH_TRIE_BITS) : 0;
+}
+
+void bulk_build(Bulk_Load *b, Hash_Map **slot, Bulk_Entry *src, Bulk_Entry *dst,
+                size lo, size hi, i32 shift)
+{
+  if (lo == hi) {
+    return;
+  }
+  if (shift == b->job_shift) {
+    b->jobs[b->jobs_count++] = (Bulk_Job){ slot, src, dst, lo, hi, shift };
+    return;
+  }
+
+  Bulk_Entry e = src[lo];
+  Hash_Map *m = *slot = &b->nodes[lo];
+  m->key   = b->keys[e.index];
+  m->value = b->values ? b->values[e.index] : (Str){0};
+  m->hash  = e.hash;
+
+  // Duplicates of this key merge into it, the last value wins like repeated
+  // upserts. The scatter is stable so later duplicates stay later.
+  size counts[HASH_TRIE_FANOUT] = {0};
+  for (size i = lo + 1; i < hi; i++) {
+    if (src[i].hash == e.hash && str_equals(b->keys[src[i].index], m->key)) {
+      m->value = b->values ? b->values[src[i].index] : m->value;
+      src[i].index = -1;
+      continue;
+    }
+    counts[bulk_digit(src[i].hash, shift)]++;
+  }
+
+  size ends[HASH_TRIE_FANOUT];
+  for (size d = 0, at = lo + 1; d < HASH_TRIE_FANOUT; d++) {
+    ends[d] = at;
+    at += counts[d];
+  }
+  for (size i = lo + 1; i < hi; i++) {
+    if (src[i].index >= 0) {
+      dst[ends[bulk_digit(src[i].hash, shift)]++] = src[i];
+    }
+  }
+  for (size d = 0; d < HASH_TRIE_FANOUT; d++) {
+    bulk_build(b, &m->child[d], dst, src, ends[d] - counts[d], ends[d], shift + HASH_TRIE_BITS);
+  }
+}
+
+void bulk_hash_worker(void *arg)
+{
+  Bulk_Load *b = arg;
+  size chunk = 1 << 14;
+  for (;;) {
+    size lo = __atomic_fetch_add(&b->next, chunk, __ATOMIC_RELAXED);
+    if (lo >= b->count) {
+      return;
+    }
+    size hi = lo + chunk < b->count ? lo + chunk : b->count;
+    for (size i = lo; i < hi; i++) {
+      b->entries[i] = (Bulk_Entry){ hash_str(b->keys[i]), i };
+    }
+  }
+}
+
+void bulk_build_worker(void *arg)
+{
+  Bulk_Load *b = arg;
+  for (;;) {
+    size j = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+    if (j >= b->jobs_count) {
+      return;
+    }
+    Bulk_Job job = b->jobs[j];
+    bulk_build(b, job.slot, job.src, job.dst, job.lo, job.hi, job.shift);
+  }
+}
+
+void bulk_run(Arena scratch, Bulk_Load *b, void (*worker)(void *))
+{
+  Thread **handles = new(&scratch, Thread *, b->threads);
+  b->next = 0;
+  for (i32 t = 1; t < b->threads; t++) {
+    handles[t] = os_thread_start(&scratch, worker, b);
+  }
+  worker(b);
+  for (i32 t = 1; t < b->threads; t++) {
+    os_thread_join(handles[t]);
+  }
+}
+
+// Builds a trie from `count` keys and optional values, with the same lookup
+// results as upserting them in order. Hashing and the subtrees below the
+// first few levels are spread over `threads` threads.
+Hash_Map *hash_map_bulk(Arena *perm, Arena scratch, Str *keys, Str *values,
+                        size count, i32 threads)
+{
+  Bulk_Load b[1] = {0};
+  b->keys    = keys;
+  b->values  = values;
+  b->count   = count;
+  b->threads = threads > 0 ? threads : 1;
+  b->nodes   = new(perm, Hash_Map, count);
+  b->entries = new(&scratch, Bulk_Entry, count);
+  Bulk_Entry *spare = new(&scratch, Bulk_Entry, count);
+  bulk_run(scratch, b, bulk_hash_worker);
+
+  // Enough subtrees for load balancing: fanout^levels >= 8 * threads
+  b->job_shift = -1;
+  if (b->threads > 1) {
+    size levels = 1, jobs_cap = HASH_TRIE_FANOUT;
+    for (; jobs_cap < 8 * b->threads; levels++) {
+      jobs_cap *= HASH_TRIE_FANOUT;
+    }
+    b->job_shift = levels * HASH_TRIE_BITS;
+    b->jobs = new(&scratch, Bulk_Job, jobs_cap);
+  }
+
+  Hash_Map *root = 0;
+  bulk_build(b, &root, b->entries, spare, 0, count, 0);
+  if (b->jobs_count) {
+    b->job_shift = -1;  // The workers build their subtrees all the way down
+    bulk_run(scratch, b, bulk_build_worker);
+  }
+  return root;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//- Flat Hash Trie
+//
+// A serialized trie is a single image: a header, then the nodes in
+// breadth-first order with their key and value bytes inline. Children are
+// byte offsets from the start of the image, 0 meaning none, so the image
+// works wherever it is mapped and lookups run directly against the file.
+// Images are only checked for their header, don't map untrusted files.
+
+#define FLAT_TRIE_MAGIC 0x0100004549525448ull  // "HTRIE\0\0\1"
+
+typedef struct Flat_Header {
+  u64 magic;
+  u32 fanout;
+  u32 root;
+  u64 count;
+  u64 len;
+} Flat_Header;
+
+typedef struct Flat_Node {
+  u64 hash;
+  u32 child[HASH_TRIE_FANOUT];
+  u32 key_len;
+  u32 value_len;
+  // Followed by the key and value bytes, padded to 8
+} Flat_Node;
+
+size flat_node_size(Hash_Map *m)
+{
+  return (sizeof(Flat_Node) + m->key.len + m->value.len + 7) & -8;
+}
+
+// Writes the live entries of `m` to an image in `perm`. Offsets are 32 bits,
+// a trie that doesn't fit in 4 GiB gives an empty image. `scratch` must not
+// overlap `perm`, it holds a compacted copy of the trie.
+Str hash_map_serialize(Arena *perm, Arena scratch, Hash_Map *m)
+{
+  // Tombstones can't be left out without moving their children
+  size total = hash_map_count(m);
+  Arena queue_arena = arena_init((u8 *)new(&scratch, Hash_Map *, total),
+                                 total * sizeof(Hash_Map *));
+  m = hash_map_compact(&scratch, queue_arena, m);
+
+  // First pass assigns offsets. A node's children are consecutive in the
+  // queue, starting at first[q].
+  size count = hash_map_count(m);
+  Hash_Map **queue = new(&scratch, Hash_Map *, count);
+  size *offset = new(&scratch, size, count);
+  size *first  = new(&scratch, size, count);
+  size tail = 0, len = sizeof(Flat_Header);
+  if (m) {
+    queue[tail++] = m;
+  }
+  for (size q = 0; q < tail; q++) {
+    offset[q] = len;
+    first[q]  = tail;
+    len += flat_node_size(queue[q]);
+    for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
+      if (queue[q]->child[i]) {
+        queue[tail++] = queue[q]->child[i];
+      }
+    }
+  }
+  if (len > 0xffffffff) {
+    return (Str){0};
+  }
+
+  u8 *image = (u8 *)new(perm, u64, len / 8);
+  Flat_Header *header = (Flat_Header *)image;
+  header->magic  = FLAT_TRIE_MAGIC;
+  header->fanout = HASH_TRIE_FANOUT;
+  header->root   = count ? offset[0] : 0;
+  header->count  = count;
+  header->len    = len;
+
+  for (size q = 0; q < count; q++) {
+    Hash_Map *n = queue[q];
+    Flat_Node *f = (Flat_Node *)(image + offset[q]);
+    f->hash      = n->hash;
+    f->key_len   = n->key.len;
+    f->value_len = n->value.len;
+    for (size i = 0, c = first[q]; i < HASH_TRIE_FANOUT; i++) {
+      f->child[i] = n->child[i] ? offset[c++] : 0;
+    }
+    u8 *bytes = (u8 *)(f + 1);
+    if (n->key.len)   { __builtin_memcpy(bytes, n->key.buf, n->key.len); }
+    if (n->value.len) { __builtin_memcpy(bytes + n->key.len, n->value.buf, n->value.len); }
+  }
+
+  return (Str){ .buf = image, .len = len };
+}
+
+b32 flat_trie_valid(Str image)
+{
+  if (image.len < (size)sizeof(Flat_Header) || (uptr)image.buf & 7) {
+    return 0;
+  }
+  Flat_Header *header = (Flat_Header *)image.buf;
+  return header->magic == FLAT_TRIE_MAGIC && header->fanout == HASH_TRIE_FANOUT &&
+         header->len == (u64)image.len && header->root < image.len;
+}
+
+// Maps a serialized trie, returns an empty image if it can't be used
+Str flat_trie_open(char *file_path)
+{
+  Str image = {0};
+  image.buf = os_map_file(file_path, &image.len);
+  return flat_trie_valid(image) ? image : (Str){0};
+}
+
+// Returns the value, pointing into the image, or a null slice if missing
+Str flat_trie_lookup(Str image, Str key)
+{
+  Flat_Header *header = (Flat_Header *)image.buf;
+  u64 hash = hash_str(key);
+  for (u64 h = hash, off = header->root; off; h <<= HASH_TRIE_BITS) {
+    Flat_Node *f = (Flat_Node *)(image.buf + off);
+    Str k = { .buf = (u8 *)(f + 1), .len = f->key_len };
+    if (f->hash == hash && str_equals(key, k)) {
+      return (Str){ .buf = k.buf + k.len, .len = f->value_len };
+    }
+    off = f->child[h >> (64 - HASH_TRIE_BITS)];
+  }
+  return (Str){0};
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //- Program
@@ -391,14 +954,17 @@ Str str_from_int(Arena *perm, i32 x)
 void append_hash_tree(Write_Buffer *b, Hash_Map *h)
 {
   // Give each child edge a different color
-  Str col_lut[4] = {
-    S("red"), S("blue"), S("green"), S("magenta"),
+  Str col_lut[16] = {
+    S("red"),    S("blue"),   S("green"),  S("magenta"),
+    S("orange"), S("cyan"),   S("purple"), S("brown"),
+    S("gold"),   S("navy"),   S("olive"),  S("pink"),
+    S("teal"),   S("maroon"), S("gray"),   S("black"),
   };
 
   append_str(b, h->key);
   append_lit(b, ";\n");
 
-  for (size i = 0; i < 4; i++) {
+  for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
     if (h->child[i]) {
       append_str(b, h->key);
       append_lit(b, " -> ");
@@ -429,18 +995,635 @@ void append_hash_tree(Write_Buffer *b, Hash_Map *h)
     }
   }
 
-  for (size i = 0; i < 4; i++) {
+  for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
     if (h->child[i]) {
       append_hash_tree(b, h->child[i]);
     }
   }
 }
 
+Str str_from_cstr(char *s)
+{
+  Str result = {0};
+  result.buf = (u8 *)s;
+  for (; s[result.len]; result.len++);
+  return result;
+}
+
+typedef struct Upsert_Job {
+  Hash_Map **root;
+  Str *keys;
+  size keys_count;
+  Arena arena;
+} Upsert_Job;
+
+void upsert_job(void *arg)
+{
+  Upsert_Job *job = arg;
+  for (size i = 0; i < job->keys_count; i++) {
+    upsert_concurrent(&job->arena, job->root, job->keys[i]);
+  }
+}
+
+// Builds one trie from `threads` threads. With `shared_keys` every thread
+// inserts every key, otherwise the keys are split evenly. Returns elapsed ns.
+i64 run_upsert_jobs(Arena scratch, Hash_Map **root, Str *keys, size keys_count,
+                    i32 threads, b32 shared_keys)
+{
+  Upsert_Job *jobs = new(&scratch, Upsert_Job, threads);
+  Thread **handles = new(&scratch, Thread *, threads);
+  size arena_capacity = (keys_count / (shared_keys ? 1 : threads) + 2) * sizeof(Hash_Map);
+  for (i32 t = 0; t < threads; t++) {
+    jobs[t].root = root;
+    jobs[t].keys = shared_keys ? keys : keys + keys_count * t / threads;
+    jobs[t].keys_count = shared_keys ? keys_count
+                                     : keys_count * (t + 1) / threads - keys_count * t / threads;
+    jobs[t].arena = arena_init(new(&scratch, u8, arena_capacity), arena_capacity);
+  }
+
+  i64 start = os_now_ns();
+  for (i32 t = 1; t < threads; t++) {
+    handles[t] = os_thread_start(&scratch, upsert_job, &jobs[t]);
+  }
+  upsert_job(&jobs[0]);
+  for (i32 t = 1; t < threads; t++) {
+    os_thread_join(handles[t]);
+  }
+  return os_now_ns() - start;
+}
+
+i32 bench_concurrent_upsert(Arena *perm, Write_Buffer *stdout, i32 max_threads)
+{
+  size keys_count = 1 << 20;
+  Str *keys = new(perm, Str, keys_count);
+  for (size i = 0; i < keys_count; i++) {
+    keys[i] = str_from_int(perm, i);
+  }
+
+  append_lit(stdout, "keys: "); append_long(stdout, keys_count);
+  append_lit(stdout, ", cores: "); append_long(stdout, os_cpu_count());
+  append_lit(stdout, "\nthreads  Kkeys/s  speedup  converged\n");
+
+  i64 baseline_ns = 0;
+  for (i32 threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+    Hash_Map *split = 0;
+    i64 ns = run_upsert_jobs(*perm, &split, keys, keys_count, threads, 0);
+    baseline_ns = baseline_ns ? baseline_ns : ns;
+    b32 converged = hash_map_count(split) == keys_count;
+
+    // Every thread inserts every key: racing inserts must converge on one node each
+    Hash_Map *shared = 0;
+    size shared_count = keys_count < (1 << 16) ? keys_count : (1 << 16);
+    run_upsert_jobs(*perm, &shared, keys, shared_count, threads, 1);
+    converged &= hash_map_count(shared) == shared_count;
+    for (size i = 0; i < shared_count; i++) {
+      converged &= upsert(0, &shared, keys[i]) != 0;
+    }
+
+    append_long(stdout, threads);
+    append_lit(stdout, "        ");
+    append_long(stdout, keys_count * 1000000 / ns);
+    append_lit(stdout, "     ");
+    append_long(stdout, baseline_ns * 100 / ns);
+    append_lit(stdout, "%     ");
+    if (converged) { append_lit(stdout, "yes\n"); }
+    else           { append_lit(stdout, "NO\n");  }
+    flush(stdout);
+
+    if (threads == max_threads) { break; }
+  }
+
+  return 0;
+}
+
+void hash_map_depths(Hash_Map *m, size depth, size *sum)
+{
+  if (!m) { return; }
+  *sum += depth;
+  for (size i = 0; i < HASH_TRIE_FANOUT; i++) {
+    hash_map_depths(m->child[i], depth + 1, sum);
+  }
+}
+
+// Appends x/100 with two decimals
+void append_fixed2(Write_Buffer *b, i64 x100)
+{
+  append_long(b, x100 / 100);
+  append_byte(b, '.');
+  append_byte(b, '0' + (x100 / 10) % 10);
+  append_byte(b, '0' + x100 % 10);
+}
+
+// Compile once per HASH_TRIE_FANOUT to compare configurations.
+i32 bench_fanout(Arena *perm, Write_Buffer *stdout, size max_keys)
+{
+  Str *keys = new(perm, Str, max_keys);
+  for (size i = 0; i < max_keys; i++) {
+    keys[i] = str_from_int(perm, i);
+  }
+
+  append_lit(stdout, "fanout: ");        append_long(stdout, HASH_TRIE_FANOUT);
+  append_lit(stdout, ", node bytes: ");  append_long(stdout, sizeof(Hash_Map));
+  append_lit(stdout, "\nkeys\tinsert ns\tlookup ns\tbytes/key\tavg depth\n");
+
+  for (size n = 1000; n <= max_keys; n *= 10) {
+    Arena nodes = *perm;
+    Hash_Map *h = 0;
+
+    i64 t0 = os_now_ns();
+    for (size i = 0; i < n; i++) {
+      *upsert(&nodes, &h, keys[i]) = keys[i];
+    }
+    i64 t1 = os_now_ns();
+
+    // Scattered order, 1000003 is prime so this visits every key once
+    size found = 0;
+    for (size i = 0; i < n; i++) {
+      found += upsert(0, &h, keys[(i * 1000003) % n]) != 0;
+    }
+    i64 t2 = os_now_ns();
+
+    size depth_sum = 0;
+    hash_map_depths(h, 0, &depth_sum);
+    if (found != n) {
+      fatal(S("FATAL: lookup missed a key\n"));
+    }
+
+    append_long(stdout, n);                              append_byte(stdout, '\t');
+    append_fixed2(stdout, (t1 - t0) * 100 / n);          append_byte(stdout, '\t');
+    append_fixed2(stdout, (t2 - t1) * 100 / n);          append_byte(stdout, '\t');
+    append_fixed2(stdout, (nodes.at - perm->at) * 100 / n); append_byte(stdout, '\t');
+    append_fixed2(stdout, depth_sum * 100 / n);          append_byte(stdout, '\n');
+    flush(stdout);
+  }
+
+  return 0;
+}
+
+// Upsert loop against the bulk constructor, single and multithreaded
+i32 bench_bulk(Arena *perm, Write_Buffer *stdout, size n, i32 max_threads)
+{
+  Str *keys = new(perm, Str, n);
+  for (size i = 0; i < n; i++) {
+    keys[i] = str_from_int(perm, i);
+  }
+
+  // Duplicates must resolve like upserts, the last value wins
+  {
+    Arena scratch = *perm;
+    size dn = n < 100000 ? n : 100000;
+    Str *dup_keys = new(&scratch, Str, dn);
+    Str *dup_vals = new(&scratch, Str, dn);
+    Hash_Map *ref = 0;
+    for (size i = 0; i < dn; i++) {
+      dup_keys[i] = keys[(i * 7) % (dn / 3 + 1)];
+      dup_vals[i] = keys[i];
+      *upsert(&scratch, &ref, dup_keys[i]) = dup_vals[i];
+    }
+    size bulk_cap = 2 * dn * sizeof(Bulk_Entry) + (1 << 20);
+    Arena bulk_scratch = arena_init((u8 *)new(&scratch, Bulk_Entry, bulk_cap / sizeof(Bulk_Entry)),
+                                    bulk_cap);
+    Arena bulk_perm = scratch;
+    Hash_Map *bulk = hash_map_bulk(&bulk_perm, bulk_scratch, dup_keys, dup_vals, dn, max_threads);
+    b32 same = hash_map_count(bulk) == hash_map_count(ref);
+    for (size i = 0; i < dn; i++) {
+      Str *v = upsert(0, &bulk, dup_keys[i]);
+      same &= v && v->buf == upsert(0, &ref, dup_keys[i])->buf;
+    }
+    if (!same) {
+      fatal(S("FATAL: bulk load differs from upserts\n"));
+    }
+  }
+
+  append_lit(stdout, "keys: ");     append_long(stdout, n);
+  append_lit(stdout, "\nbuild\t\tthreads\tns/key\tlookup ns\n");
+  for (i32 run = 0; run < 3; run++) {
+    Arena nodes = *perm;
+    size scratch_cap = 2 * n * sizeof(Bulk_Entry) + (1 << 20);
+    Arena scratch = arena_init((u8 *)new(&nodes, Bulk_Entry, scratch_cap / sizeof(Bulk_Entry)),
+                               scratch_cap);
+    i32 threads = run == 2 ? max_threads : 1;
+    Hash_Map *h = 0;
+
+    i64 t0 = os_now_ns();
+    if (run == 0) {
+      for (size i = 0; i < n; i++) {
+        *upsert(&nodes, &h, keys[i]) = keys[i];
+      }
+    }
+    else {
+      h = hash_map_bulk(&nodes, scratch, keys, keys, n, threads);
+    }
+    i64 t1 = os_now_ns();
+    size found = 0;
+    for (size i = 0; i < n; i++) {
+      Str *v = upsert(0, &h, keys[(i * 1000003) % n]);
+      found += v && v->buf == keys[(i * 1000003) % n].buf;
+    }
+    i64 t2 = os_now_ns();
+    if (found != n || hash_map_count(h) != n) {
+      fatal(S("FATAL: bulk load lost a key\n"));
+    }
+
+    if (run == 0) { append_lit(stdout, "upsert\t\t"); }
+    else          { append_lit(stdout, "hash_map_bulk\t"); }
+    append_long(stdout, threads);                 append_byte(stdout, '\t');
+    append_fixed2(stdout, (t1 - t0) * 100 / n);   append_byte(stdout, '\t');
+    append_fixed2(stdout, (t2 - t1) * 100 / n);   append_byte(stdout, '\n');
+    flush(stdout);
+  }
+  return 0;
+}
+
+// The byte-at-a-time hash and compare, and the upsert that used them,
+// kept as the baseline for bench-hash.
+u64 hash_str_bytewise(Str s)
+{
+  u64 h = 0x100;
+  for (size i = 0; i < s.len; i++) {
+    h ^= s.buf[i];
+    h *= 1111111111111111111u;
+  }
+  return h;
+}
+
+b32 str_equals_bytewise(Str a, Str b)
+{
+  if (a.len != b.len) { return 0; }
+  for (size i = 0; i < a.len; i++) {
+    if (a.buf[i] != b.buf[i]) { return 0; }
+  }
+  return 1;
+}
+
+Str *upsert_bytewise(Arena *perm, Hash_Map **m, Str key)
+{
+  for (u64 h = hash_str_bytewise(key); *m; h <<= HASH_TRIE_BITS) {
+    if (str_equals_bytewise(key, (*m)->key)) {
+      return &(*m)->value;
+    }
+    m = &(*m)->child[h >> (64 - HASH_TRIE_BITS)];
+  }
+
+  if (!perm) {
+    return 0;
+  }
+
+  *m = new(perm, Hash_Map);
+  (*m)->key = key;
+  return &(*m)->value;
+}
+
+// Keys of `len` bytes sharing a long prefix, distinct in the last 8 bytes,
+// which is the worst case for a byte-wise compare.
+Str *make_prefixed_keys(Arena *perm, size count, size len)
+{
+  Str *keys = new(perm, Str, count);
+  for (size i = 0; i < count; i++) {
+    keys[i].buf = new(perm, u8, len);
+    keys[i].len = len;
+    for (size j = 0; j < len; j++) {
+      keys[i].buf[j] = "tenant/region/session/"[j % 22];
+    }
+    for (size j = 0, x = i; j < 8; j++, x /= 10) {
+      keys[i].buf[len - 1 - j] = '0' + x % 10;
+    }
+  }
+  return keys;
+}
+
+i32 bench_hash(Arena *perm, Write_Buffer *stdout)
+{
+  size n = 1 << 20;
+  size lens[] = { 8, 16, 32, 64 };
+
+  append_lit(stdout, "keys: "); append_long(stdout, n);
+  append_lit(stdout, "\nkey len\thash old\thash new\tlookup old\tlookup new\tspeedup\n");
+  for (size l = 0; l < countof(lens); l++) {
+    Arena scratch = *perm;
+    Str *keys = make_prefixed_keys(&scratch, n, lens[l]);
+
+    u64 sink = 0;
+    i64 t0 = os_now_ns();
+    for (size i = 0; i < n; i++) { sink += hash_str_bytewise(keys[i]); }
+    i64 t1 = os_now_ns();
+    for (size i = 0; i < n; i++) { sink += hash_str(keys[i]); }
+    i64 t2 = os_now_ns();
+
+    Hash_Map *old = 0, *cur = 0;
+    for (size i = 0; i < n; i++) {
+      upsert_bytewise(&scratch, &old, keys[i]);
+      upsert(&scratch, &cur, keys[i]);
+    }
+
+    i64 t3 = os_now_ns();
+    for (size i = 0; i < n; i++) { sink += upsert_bytewise(0, &old, keys[(i * 1000003) % n]) != 0; }
+    i64 t4 = os_now_ns();
+    for (size i = 0; i < n; i++) { sink += upsert(0, &cur, keys[(i * 1000003) % n]) != 0; }
+    i64 t5 = os_now_ns();
+
+    append_long(stdout, lens[l]);                 append_byte(stdout, '\t');
+    append_fixed2(stdout, (t1 - t0) * 100 / n);   append_byte(stdout, '\t');
+    append_fixed2(stdout, (t2 - t1) * 100 / n);   append_byte(stdout, '\t');
+    append_fixed2(stdout, (t4 - t3) * 100 / n);   append_byte(stdout, '\t');
+    append_fixed2(stdout, (t5 - t4) * 100 / n);   append_byte(stdout, '\t');
+    append_fixed2(stdout, (t4 - t3) * 100 / (t5 - t4));
+    append_lit(stdout, "x\n");
+    flush(stdout);
+    *(volatile u64 *)&sink = sink;
+  }
+
+  return 0;
+}
+
+// Lookups and a full iteration on a trie with a quarter of its keys deleted,
+// before and after compaction. Keys and nodes start out interleaved in the
+// arena the way an insert loop leaves them.
+i32 bench_compact(Arena *perm, Write_Buffer *stdout)
+{
+  size n = 1 << 20;
+  Str *keys = new(perm, Str, n);
+  Hash_Map *h = 0;
+  u8 *beg = perm->at;
+  for (size i = 0; i < n; i++) {
+    keys[i] = str_from_int(perm, i);
+    *upsert(perm, &h, keys[i]) = keys[i];
+  }
+  size before_bytes = perm->at - beg;
+  for (size i = 0; i < n; i += 4) {
+    hash_map_delete(h, keys[i]);
+  }
+
+  size scratch_cap = n * sizeof(Hash_Map *);
+  Arena scratch = arena_init((u8 *)new(perm, Hash_Map *, n), scratch_cap);
+  beg = perm->at;
+  i64 t0 = os_now_ns();
+  Hash_Map *c = hash_map_compact(perm, scratch, h);
+  i64 t1 = os_now_ns();
+  size after_bytes = perm->at - beg;
+
+  // Queries use their own copy of the keys, otherwise the original trie
+  // compares a key with itself and gets the key bytes for free.
+  Str *queries = new(perm, Str, n);
+  for (size i = 0; i < n; i++) {
+    queries[i] = str_from_int(perm, (i * 1000003) % n);
+  }
+
+  Hash_Map *tries[] = { h, c };
+  i64 iter_ns[2], lookup_ns[2];
+  for (size t = 0; t < 2; t++) {
+    Arena scratch = *perm;
+    size live = 0, sum = 0;
+    i64 t2 = os_now_ns();
+    Hash_Map_Iter it = hash_map_iter(&scratch, tries[t]);
+    for (Hash_Map *m; (m = hash_map_next(&it));) {
+      live++;
+      sum += m->value.len;
+    }
+    i64 t3 = os_now_ns();
+    size found = 0;
+    for (size i = 0; i < n; i++) {
+      found += upsert(0, &tries[t], queries[i]) != 0;
+    }
+    i64 t4 = os_now_ns();
+
+    if (live != n - n / 4 || found != live) {
+      fatal(S("FATAL: compaction lost or revived a key\n"));
+    }
+    iter_ns[t]   = t3 - t2;
+    lookup_ns[t] = t4 - t3;
+    *(volatile size *)&sum = sum;
+  }
+
+  append_lit(stdout, "keys: ");           append_long(stdout, n);
+  append_lit(stdout, ", live: ");         append_long(stdout, n - n / 4);
+  append_lit(stdout, ", compact ms: ");   append_fixed2(stdout, (t1 - t0) / 10000);
+  append_lit(stdout, "\n\tbytes\titer ns\tlookup ns\n");
+  append_lit(stdout, "before\t");         append_long(stdout, before_bytes);
+  append_byte(stdout, '\t');              append_fixed2(stdout, iter_ns[0] * 100 / n);
+  append_byte(stdout, '\t');              append_fixed2(stdout, lookup_ns[0] * 100 / n);
+  append_lit(stdout, "\nafter\t");       append_long(stdout, after_bytes);
+  append_byte(stdout, '\t');              append_fixed2(stdout, iter_ns[1] * 100 / n);
+  append_byte(stdout, '\t');              append_fixed2(stdout, lookup_ns[1] * 100 / n);
+  append_byte(stdout, '\n');
+  flush(stdout);
+  return 0;
+}
+
+// A published version of a persistent trie, `count` is the number of keys
+// from the start of the key array that it contains.
+typedef struct Trie_Version {
+  Hash_Map *root;
+  size count;
+} Trie_Version;
+
+typedef struct Snapshot_Reader {
+  Trie_Version **current;
+  Str *keys;
+  size keys_count;
+  b32 *done;
+  size lookups;
+  size errors;
+} Snapshot_Reader;
+
+// Looks up keys in whatever version is current and checks that it holds
+// exactly its own keys, even though the writer keeps inserting.
+void snapshot_reader(void *arg)
+{
+  Snapshot_Reader *r = arg;
+  u64 rng = 1;
+  while (!__atomic_load_n(r->done, __ATOMIC_ACQUIRE)) {
+    Trie_Version *v = __atomic_load_n(r->current, __ATOMIC_ACQUIRE);
+    for (size i = 0; i < 1024; i++) {
+      rng = rng * 6364136223846793005u + 1442695040888963407u;
+      size k = (rng >> 33) % r->keys_count;
+      Str *value = upsert(0, &v->root, r->keys[k]);
+      r->errors += (value != 0) != (k < v->count);
+      r->errors += value && value->buf != r->keys[k].buf;
+    }
+    r->lookups += 1024;
+  }
+}
+
+i32 bench_persistent(Arena *perm, Write_Buffer *stdout)
+{
+  size n = 1 << 18, batch = 1024;
+  Str *keys = new(perm, Str, 2 * n);
+  for (size i = 0; i < 2 * n; i++) {
+    keys[i] = str_from_int(perm, i);
+  }
+
+  Trie_Version *current = new(perm, Trie_Version);
+  i64 t0 = os_now_ns();
+  for (size i = 0; i < n; i++) {
+    *upsert(perm, &current->root, keys[i]) = keys[i];
+  }
+  i64 t1 = os_now_ns();
+  current->count = n;
+
+  Trie_Version *base = current;
+  b32 done = 0;
+  Snapshot_Reader reader = { &current, keys, 2 * n, &done };
+  Thread *thread = os_thread_start(perm, snapshot_reader, &reader);
+
+  u8 *beg = perm->at;
+  i64 t2 = os_now_ns();
+  for (size i = n; i < 2 * n; i += batch) {
+    Trie_Version *next = new(perm, Trie_Version);
+    next->root = current->root;
+    u8 *version_beg = perm->at;
+    for (size j = i; j < i + batch; j++) {
+      *upsert_persistent(perm, &next->root, keys[j], version_beg) = keys[j];
+    }
+    next->count = i + batch;
+    __atomic_store_n(&current, next, __ATOMIC_RELEASE);
+  }
+  i64 t3 = os_now_ns();
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  os_thread_join(thread);
+
+  // The base version is untouched by all the inserts after it
+  size stale = 0;
+  for (size i = 0; i < 2 * n; i++) {
+    stale += (upsert(0, &base->root, keys[i]) != 0) != (i < n);
+  }
+
+  append_lit(stdout, "base keys: ");        append_long(stdout, n);
+  append_lit(stdout, ", versions: ");       append_long(stdout, n / batch);
+  append_lit(stdout, " of ");               append_long(stdout, batch);
+  append_lit(stdout, " keys\nin-place upsert ns: ");  append_fixed2(stdout, (t1 - t0) * 100 / n);
+  append_lit(stdout, "\npersistent upsert ns: ");     append_fixed2(stdout, (t3 - t2) * 100 / n);
+  append_lit(stdout, "\npersistent bytes/key: ");     append_fixed2(stdout, (perm->at - beg) * 100 / n);
+  append_lit(stdout, "\nreader lookups: ");           append_long(stdout, reader.lookups);
+  append_lit(stdout, ", errors: ");                   append_long(stdout, reader.errors + stale);
+  append_byte(stdout, '\n');
+  flush(stdout);
+  return reader.errors + stale != 0;
+}
+
+// Startup cost of building the trie against serializing it once and
+// mapping the file, then lookups in the pointer trie and the mapped image.
+i32 bench_flat(Arena *perm, Write_Buffer *stdout, size n)
+{
+  char *file_path = "trie.bin";
+  Str *keys = new(perm, Str, n);
+  for (size i = 0; i < n; i++) {
+    keys[i] = str_from_int(perm, i);
+  }
+
+  i64 t0 = os_now_ns();
+  Hash_Map *h = 0;
+  for (size i = 0; i < n; i++) {
+    *upsert(perm, &h, keys[i]) = keys[i];
+  }
+  i64 t1 = os_now_ns();
+
+  // Compacted copy, queue and offsets, with room for short keys
+  size scratch_cap = n * (sizeof(Hash_Map) + 64);
+  Arena scratch = arena_init((u8 *)new(perm, u64, scratch_cap / 8), scratch_cap);
+  i64 t2 = os_now_ns();
+  Str image = hash_map_serialize(perm, scratch, h);
+  if (!image.buf || !os_write_file(file_path, image.buf, image.len)) {
+    fatal(S("FATAL: Failed to write trie.bin\n"));
+  }
+  i64 t3 = os_now_ns();
+  Str mapped = flat_trie_open(file_path);
+  if (!mapped.buf) {
+    fatal(S("FATAL: Failed to map trie.bin\n"));
+  }
+  i64 t4 = os_now_ns();
+
+  Str *queries = new(perm, Str, n);
+  for (size i = 0; i < n; i++) {
+    queries[i] = str_from_int(perm, (i * 1000003) % n);
+  }
+
+  size found = 0;
+  i64 t5 = os_now_ns();
+  for (size i = 0; i < n; i++) {
+    found += upsert(0, &h, queries[i]) != 0;
+  }
+  i64 t6 = os_now_ns();
+  for (size i = 0; i < n; i++) {
+    Str v = flat_trie_lookup(mapped, queries[i]);
+    found += v.buf && str_equals(v, queries[i]);
+  }
+  i64 t7 = os_now_ns();
+  found += !flat_trie_lookup(mapped, S("missing")).buf;
+  if (found != 2 * n + 1) {
+    fatal(S("FATAL: flat trie lookup mismatch\n"));
+  }
+
+  append_lit(stdout, "keys: ");               append_long(stdout, n);
+  append_lit(stdout, ", file bytes: ");       append_long(stdout, mapped.len);
+  append_lit(stdout, "\nbuild ms: ");         append_fixed2(stdout, (t1 - t0) / 10000);
+  append_lit(stdout, "\nserialize+write ms: "); append_fixed2(stdout, (t3 - t2) / 10000);
+  append_lit(stdout, "\nmap ms: ");           append_fixed2(stdout, (t4 - t3) / 10000);
+  append_lit(stdout, "\nlookup ns: ");        append_fixed2(stdout, (t6 - t5) * 100 / n);
+  append_lit(stdout, " pointer, ");           append_fixed2(stdout, (t7 - t6) * 100 / n);
+  append_lit(stdout, " mapped\n");
+  flush(stdout);
+  return 0;
+}
+
 i32 run(Arena *perm, i32 argc, char *argv[])
 {
   size stdout_capacity = 8 * 1024;
   Write_Buffer stdout[1] = { fd_buffer(1, new(perm, u8, stdout_capacity), stdout_capacity) };
 
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-mt"))) {
+    i32 max_threads = os_cpu_count();
+    if (argc > 2) {
+      Parse_Result r = parse_i64_ex(str_from_cstr(argv[2]), 1, 1024);
+      max_threads = r.status == Parse_Status_Ok ? (i32)r.val : max_threads;
+    }
+    return bench_concurrent_upsert(perm, stdout, max_threads);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-fanout"))) {
+    size max_keys = 10000000;
+    if (argc > 2) {
+      Parse_Result r = parse_i64_ex(str_from_cstr(argv[2]), 1000, 99999999);
+      max_keys = r.status == Parse_Status_Ok ? r.val : max_keys;
+    }
+    return bench_fanout(perm, stdout, max_keys);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-hash"))) {
+    return bench_hash(perm, stdout);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-compact"))) {
+    return bench_compact(perm, stdout);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-persistent"))) {
+    return bench_persistent(perm, stdout);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-bulk"))) {
+    size keys = 4000000;
+    if (argc > 2) {
+      Parse_Result r = parse_i64_ex(str_from_cstr(argv[2]), 1000, 20000000);
+      keys = r.status == Parse_Status_Ok ? r.val : keys;
+    }
+    i32 threads = os_cpu_count();
+    if (argc > 3) {
+      Parse_Result r = parse_i64_ex(str_from_cstr(argv[3]), 1, 1024);
+      threads = r.status == Parse_Status_Ok ? (i32)r.val : threads;
+    }
+    return bench_bulk(perm, stdout, keys, threads);
+  }
+
+  if (argc > 1 && str_equals(str_from_cstr(argv[1]), S("bench-flat"))) {
+    size keys = 1000000;
+    if (argc > 2) {
+      Parse_Result r = parse_i64_ex(str_from_cstr(argv[2]), 1, 20000000);
+      keys = r.status == Parse_Status_Ok ? r.val : keys;
+    }
+    return bench_flat(perm, stdout, keys);
+  }
+
   // Parse cli arguments
   b32 create_anim = (argc > 1);
   size iterations = 32;
@@ -458,35 +1641,21 @@ i32 run(Arena *perm, i32 argc, char *argv[])
     iterations = r.val;
   }
 
-  Str dir_path = S("./out/");
-  if (create_anim) {
-    os_mkdir((char *)dir_path.buf);
-  }
-
   {
     Hash_Map *h = 0;
+    Pipe pipe = {0};
+    Write_Buffer b[1] = {0};
+    if (create_anim) {
+      pipe = os_start_render("trie.mkv");
+      b[0] = fd_buffer(pipe.write_fd, new(perm, u8, 64 * 1024), 64 * 1024);
+    }
+
     for (size i = 0; i < iterations ; i++) {
       Str key = str_from_int(perm, i);
       Str val = key;
       *upsert(perm, &h, key) = val;
 
       if (create_anim) {
-        Arena temp = *perm;
-        Pipe pipe = {0};
-        {
-          Write_Buffer file_path = write_buffer(new(&temp, u8, 128), 128);
-          append_str(&file_path, dir_path);
-          if      (i < 10)  { append_lit(&file_path, "00"); }
-          else if (i < 100) { append_lit(&file_path, "0");  }
-          assert(i < 1000);
-          append_long(&file_path, i);
-          append_lit(&file_path, ".svg");
-          append_byte(&file_path, 0);
-          pipe = os_start_graphviz((char *)file_path.buf);
-        }
-        assert(pipe.write_fd > 0);
-        Write_Buffer b[1] = { fd_buffer(pipe.write_fd, new(&temp, u8, 8 * 1024), 8 * 1024), };
-
         append_lit(b, "digraph hash_trie_it {\n");
         append_lit(b, "labelloc=t\n");
         append_lit(b, "label=\"items: "); append_long(b, i + 1); append_lit(b, "\";\n");
@@ -494,9 +1663,6 @@ i32 run(Arena *perm, i32 argc, char *argv[])
         append_lit(b, "node [ shape=box ];\n");
         append_hash_tree(b, h);
         append_lit(b, "}\n");
-
-        flush(b);
-        os_stop_graphviz(pipe);
       }
     }
 
@@ -507,7 +1673,10 @@ i32 run(Arena *perm, i32 argc, char *argv[])
       append_lit(stdout, "}\n");
     }
     else {
-      os_ffmpeg("trie.mkv");
+      flush(b);
+      if (!os_stop_render(pipe)) {
+        fatal(S("FATAL: dot or ffmpeg failed\n"));
+      }
     }
 
     flush(stdout);
@@ -524,128 +1693,148 @@ i32 run(Arena *perm, i32 argc, char *argv[])
 #include <stdio.h>
 #include <fcntl.h>
 
-#ifdef __MINGW32__
-#define mkdir(p, m) mkdir(p)
-#else
+#ifndef __MINGW32__
 #include <sys/stat.h>
 #include <sys/wait.h>
 #endif
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+struct Thread {
+  pthread_t handle;
+  void (*entry)(void *);
+  void *arg;
+};
 
-Pipe os_start_graphviz(char *out_file)
+static void *os_thread_trampoline(void *arg)
+{
+  Thread *thread = arg;
+  thread->entry(thread->arg);
+  return 0;
+}
+
+Thread *os_thread_start(Arena *perm, void (*entry)(void *), void *arg)
+{
+  Thread *thread = new(perm, Thread);
+  thread->entry = entry;
+  thread->arg = arg;
+  if (pthread_create(&thread->handle, 0, os_thread_trampoline, thread) != 0) {
+    fatal(S("FATAL: Failed to create thread\n"));
+  }
+  return thread;
+}
+
+b32 os_thread_join(Thread *thread)
+{
+  return pthread_join(thread->handle, 0) == 0;
+}
+
+i32 os_cpu_count(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (i32)n : 1;
+}
+
+i64 os_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// One dot renders all graphs from its stdin to concatenated PNGs, which one
+// ffmpeg reads as an image stream. No temporary files, two processes total.
+Pipe os_start_render(char *out_file)
 {
   int READ_END  = 0;
   int WRITE_END = 1;
-  int fd[2];
+  int to_dot[2], to_ffmpeg[2];
 
-  if (pipe(fd) < 0) {
+  if (pipe(to_dot) < 0 || pipe(to_ffmpeg) < 0) {
     fatal(S("FATAL: Failed to create pipe\n"));
   }
 
-  pid_t child = fork();
-  if (child < 0) {
+  pid_t dot = fork();
+  if (dot < 0) {
     fatal(S("FATAL: Failed to fork a child\n"));
   }
 
-  if (child == 0) {
-    if (dup2(fd[READ_END], STDIN_FILENO) < 0) {
-      fatal(S("FATAL: Failed to dup2 pipe as stdin from parent.\n"));
+  if (dot == 0) {
+    if (dup2(to_dot[READ_END], STDIN_FILENO) < 0 ||
+        dup2(to_ffmpeg[WRITE_END], STDOUT_FILENO) < 0) {
+      fatal(S("FATAL: Failed to dup2 pipes for dot.\n"));
     }
-    os_close(fd[WRITE_END]);
+    os_close(to_dot[READ_END]);
+    os_close(to_dot[WRITE_END]);
+    os_close(to_ffmpeg[READ_END]);
+    os_close(to_ffmpeg[WRITE_END]);
+
+    execlp("dot", "dot", "-Tpng", (char *)0);
+    fatal(S("FATAL: command `dot` failed\n"));
+  }
 
-    int ret = execlp("dot",
-                     "dot",
-                     "-T",
-                     "svg",
-                     "-o",
-                     out_file,
-                     0);
+  os_close(to_dot[READ_END]);
+  os_close(to_ffmpeg[WRITE_END]);
 
-    if (ret < 0) {
-      fatal(S("FATAL: command `dot` failed\n"));
-    }
+  pid_t ffmpeg = fork();
+  if (ffmpeg < 0) {
+    fatal(S("FATAL: Failed to fork a child\n"));
+  }
 
-    assert(0 && "unreachable");
-    os_exit(1);
+  if (ffmpeg == 0) {
+    if (dup2(to_ffmpeg[READ_END], STDIN_FILENO) < 0) {
+      fatal(S("FATAL: Failed to dup2 pipe for ffmpeg.\n"));
+    }
+    // Holding dot's stdin open here would keep dot from ever seeing EOF
+    os_close(to_dot[WRITE_END]);
+    os_close(to_ffmpeg[READ_END]);
+
+    execlp("ffmpeg",
+           "ffmpeg",
+           "-y",
+           "-loglevel", "error",
+           "-f", "image2pipe",
+           "-framerate", "1/2",
+           "-c:v", "png",
+           "-i", "pipe:0",
+           "-s", "1920x480",
+           out_file,
+           (char *)0);
+    fatal(S("FATAL: command `ffmpeg` failed\n"));
   }
 
-  os_close(fd[READ_END]);
+  os_close(to_ffmpeg[READ_END]);
 
   Pipe r = {0};
-  r.write_fd = fd[WRITE_END];
-  r.pid = child;
+  r.write_fd   = to_dot[WRITE_END];
+  r.dot_pid    = dot;
+  r.ffmpeg_pid = ffmpeg;
   return r;
 }
 
-b32 os_stop_graphviz(Pipe pipe)
+static b32 os_wait(pid_t pid)
 {
-  pid_t pid = pipe.pid;
-  int   fd  = pipe.write_fd;
-
-  os_close(fd);
-
   for (;;) {
     int wstatus = 0;
     if (waitpid(pid, &wstatus, 0) < 0) {
       return 0;
     }
-
     if (WIFEXITED(wstatus)) {
-      int exit_status = WEXITSTATUS(wstatus);
-      if (exit_status != 0) {
-        return 0;
-      }
-      return 1;
-    }
-  }
-
-  return 0;
-}
-
-b32 os_ffmpeg(char *out_file)
-{
-  pid_t child = fork();
-  if (child < 0) {
-    fatal(S("FATAL: Failed to fork a child\n"));
-  }
-
-  if (child == 0) {
-    int ret = execlp("ffmpeg",
-                     "ffmpeg",
-                     "-y",
-                     "-framerate", "1/2",
-                     "-pattern_type", "glob",
-                     "-i", "./out/*.svg",
-                     "-s", "1920x480",
-                     out_file,
-                     0);
-
-    if (ret < 0) {
-      fatal(S("FATAL: command `ffmpeg` failed\n"));
+      return WEXITSTATUS(wstatus) == 0;
     }
-
-    assert(0 && "unreachable");
-  }
-
-  for (;;) {
-    int wstatus;
-    if (waitpid(child, &wstatus, 0) < 0) {
+    if (WIFSIGNALED(wstatus)) {
       return 0;
     }
-    if (WIFEXITED(wstatus)) {
-      int exit_status = WEXITSTATUS(wstatus);
-      if (exit_status != 0) {
-        return 0;
-      }
-      return 1;
-    }
   }
-  return 0;
 }
 
-
-int os_mkdir(char *dir_path)
+// Closing dot's stdin ends the stream, dot exits and then ffmpeg sees EOF
+b32 os_stop_render(Pipe pipe)
 {
-  return mkdir(dir_path, 0755);
+  os_close(pipe.write_fd);
+  b32 ok = os_wait(pipe.dot_pid);
+  return os_wait(pipe.ffmpeg_pid) && ok;
 }
 
 int os_open(char *file_path)
@@ -670,14 +1859,55 @@ b32 os_write(i32 fd, u8 *buf, size len)
   return 1;
 }
 
+b32 os_write_file(char *file_path, u8 *buf, size len)
+{
+  int fd = open(file_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    return 0;
+  }
+  b32 ok = os_write(fd, buf, len);
+  return os_close(fd) && ok;
+}
+
+// Read-only shared mapping, pages come from the page cache. Never unmapped.
+u8 *os_map_file(char *file_path, size *len)
+{
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    os_close(fd);
+    return 0;
+  }
+  void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  os_close(fd);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  *len = st.st_size;
+  return p;
+}
+
 void os_exit (int status)
 {
   exit(status);
 }
 
+u8 *os_reserve(size capacity)
+{
+  void *p = mmap(0, capacity, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? 0 : p;
+}
+
 int main(int argc, char **argv)
 {
-  Arena heap[1] = { arena_init((u8 *)malloc(HEAP_CAPACITY), HEAP_CAPACITY) };
+  u8 *backing = os_reserve(HEAP_CAPACITY);
+  if (!backing) {
+    fatal(S("FATAL: Failed to reserve the heap\n"));
+  }
+  Arena heap[1] = { arena_init(backing, HEAP_CAPACITY) };
   return run(heap, argc, argv);
 }
 
@@ -88,83 +88,227 @@ static Cut str_cut(Str s, Size i) {
 #include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
 
 #include <signal.h>
 
+#define free_list_pop(freelist) ({ \
+  __typeof(freelist) s = freelist; \
+  freelist = freelist->next;  \
+  s; \
+})
+
+#define free_list_push(freelist, n) ((n)->next = (freelist), (freelist) = (n))
+
+// Every connection holds one Request from accept until its close completes.
+// Requests come from a fixed pool carved out of the heap at startup, so
+// memory stays flat however many connections come and go. The pool is no
+// larger than the fd limit leaves room for, see pools_init.
+//
+// Read buffers are not tied to connections. They sit in a buffer ring
+// registered with the kernel, which picks one only when data arrives, so an
+// idle connection pins none. A buffer goes back to the ring once its data
+// has been handled.
+enum {
+  MAX_CONNECTIONS  = 1024,
+  RESERVED_FDS     = 8,   // stdio, listen socket, ring and some slack
+  READ_BUFFER_SIZE = 4096,
+  READ_BUFFERS     = 64,  // power of two, as the ring requires
+  READ_BUFFER_GROUP = 0,
+};
+
+typedef struct Request Request;
+struct Request {
+  int state;
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len;
+  int client_fd;
+  U8 *client_request; // the ring buffer picked for the read, or null
+  int buffer_id;
+  struct iovec iovecs[16]; // must outlive the call until the flush submits it
+  Request *next;
+};
+
 typedef struct State State;
 struct State {
   B32 should_close;
   struct io_uring ring;
+  U64 enter_calls; // submits that enter the kernel: one io_uring_enter each without SQPOLL
+  U64 connections;
+
+  int sock;
+  B32 accept_stalled; // out of Requests or fds; re-armed by the next release
+  Request accept_timer; // re-arms a stalled accept when nothing is left to release
+  struct __kernel_timespec accept_backoff;
+  Size requests_in_use;
+  Size requests_peak;
+
+  Size max_connections;
+  Request *requests_array;
+  Request *requests_first_free;
+  struct io_uring_buf_ring *buffer_ring;
+  U8 *buffers;
+  Size buffers_held; // picked by the kernel and not yet given back
+  Request *reads_starved; // found the ring empty, re-queued as buffers return
 } state = {0};
 
-typedef struct Request {
-  int state;
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len;
-  int client_fd;
-  U8 *client_request;
-} Request;
+void pools_init(Arena *arena)
+{
+  // Each Request holds at most one client fd, so with the pool sized below
+  // RLIMIT_NOFILE running out of Requests stalls accept before EMFILE does.
+  Size max = MAX_CONNECTIONS;
+  struct rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY &&
+      (Size)nofile.rlim_cur - RESERVED_FDS < max) {
+    max = (Size)nofile.rlim_cur - RESERVED_FDS;
+  }
+  assert(max > 0);
+  state.max_connections = max;
+
+  state.requests_array = state.requests_first_free = new(arena, Request, max);
+  for (Size i = 1; i < max; i++) { state.requests_array[i - 1].next = &state.requests_array[i]; }
+}
+
+void buffer_ring_init(Arena *arena)
+{
+  int err = 0;
+  state.buffer_ring = io_uring_setup_buf_ring(&state.ring, READ_BUFFERS,
+                                              READ_BUFFER_GROUP, 0, &err);
+  if (!state.buffer_ring) {
+    fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-err));
+    exit(1);
+  }
+
+  state.buffers = new(arena, U8, READ_BUFFERS * READ_BUFFER_SIZE);
+  int mask = io_uring_buf_ring_mask(READ_BUFFERS);
+  for (int i = 0; i < READ_BUFFERS; i++) {
+    io_uring_buf_ring_add(state.buffer_ring, state.buffers + i * READ_BUFFER_SIZE,
+                          READ_BUFFER_SIZE, i, mask, i);
+  }
+  io_uring_buf_ring_advance(state.buffer_ring, READ_BUFFERS);
+}
+
+void queue_read(Request *req, int client);
+
+void release_buffer(Request *req)
+{
+  if (!req->client_request) return;
+  io_uring_buf_ring_add(state.buffer_ring, req->client_request, READ_BUFFER_SIZE,
+                        req->buffer_id, io_uring_buf_ring_mask(READ_BUFFERS), 0);
+  io_uring_buf_ring_advance(state.buffer_ring, 1);
+  req->client_request = 0;
+  state.buffers_held--;
+
+  if (state.reads_starved) { // the buffer just returned is theirs
+    Request *starved = free_list_pop(state.reads_starved);
+    queue_read(starved, starved->client_fd);
+  }
+}
+
+// SQEs are only queued here; main flushes them all with one
+// io_uring_submit_and_wait per loop iteration. A full submission queue is
+// the one case that flushes early.
+struct io_uring_sqe *get_sqe(void)
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
+  if (!sqe) {
+    io_uring_submit(&state.ring);
+    state.enter_calls++;
+    sqe = io_uring_get_sqe(&state.ring);
+  }
+  assert(sqe);
+  return sqe;
+}
 
-void queue_accept(Arena *arena, int sock)
+void queue_accept(int sock)
 {
-  Request *req = new(arena, Request, 1); // TODO: pool these in a freelist
+  if (!state.requests_first_free) {
+    state.accept_stalled = 1;
+    return;
+  }
+  Request *req = free_list_pop(state.requests_first_free);
+  *req = (Request){0};
   req->state = 1;
+  state.requests_in_use++;
+  state.requests_peak = state.requests_in_use > state.requests_peak ? state.requests_in_use : state.requests_peak;
 
   req->client_addr_len = sizeof req->client_addr;
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
+  struct io_uring_sqe *sqe = get_sqe();
   io_uring_prep_accept(sqe, sock, (struct sockaddr *)&req->client_addr,
                        &req->client_addr_len, 0);
   io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&state.ring);
 }
 
-void queue_read(Arena *arena, Request *req, int client)
+void release_request(Request *req)
+{
+  release_buffer(req);
+  free_list_push(state.requests_first_free, req);
+  state.requests_in_use--;
+
+  if (state.accept_stalled) {
+    state.accept_stalled = 0;
+    queue_accept(state.sock);
+  }
+}
+
+// Accept failed for lack of fds or memory, which only a closed connection
+// gives back. Retrying at once would spin, so the accept waits for the next
+// release, or for a back-off timeout when no connection is left to close.
+void stall_accept(void)
+{
+  state.accept_stalled = 1;
+  if (state.requests_in_use == 0) {
+    state.accept_timer.state = 5;
+    state.accept_backoff = (struct __kernel_timespec){ .tv_nsec = 100 * 1000 * 1000 };
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &state.accept_backoff, 0, 0);
+    io_uring_sqe_set_data(sqe, &state.accept_timer);
+  }
+}
+
+void queue_read(Request *req, int client)
 {
-  Size buf_len = 4096;
-  req->client_request = new(arena, U8, buf_len); // TODO pool these buffers
   req->state = 2;
 
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
-  io_uring_prep_read(sqe, req->client_fd, req->client_request, buf_len, 0);
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_read(sqe, req->client_fd, 0, READ_BUFFER_SIZE, 0);
+  io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+  sqe->buf_group = READ_BUFFER_GROUP;
   io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&state.ring);
 }
 
 void queue_write_(Request *req, Str strs[], Size strs_count)
 {
   req->state = 3;
 
-  enum { MAX_STRS = 16 };
-  assert(strs_count < 16 && strs_count > 0);
+  assert(strs_count < count_of(req->iovecs) && strs_count > 0);
   U64 offset = 0;
   int flags = 0;
-  struct iovec iovecs[MAX_STRS] = {0};
+  struct iovec *iovecs = req->iovecs;
   for (int i = 0; i < strs_count; i++) {
     iovecs[i] = (struct iovec){ .iov_base = strs[i].buf, .iov_len = strs[i].len };
   }
 
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
+  struct io_uring_sqe *sqe = get_sqe();
   io_uring_prep_writev2(sqe, req->client_fd, iovecs, strs_count, offset, flags);
   io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&state.ring);
 }
 
 void queue_write(Request *req, U8 *response, Size len)
 {
   req->state = 3;
 
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
+  struct io_uring_sqe *sqe = get_sqe();
   io_uring_prep_write(sqe, req->client_fd, response, len, 0);
   io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&state.ring);
 }
 
 void queue_close(Request *req) {
   req->state = 4;
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&state.ring);
+  struct io_uring_sqe *sqe = get_sqe();
   io_uring_prep_close(sqe, req->client_fd);
   io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&state.ring);
 }
 
 int initialize_socket(Str sock_path)
@@ -216,68 +360,141 @@ static Arena *new_arena(Size capacity)
   return a;
 }
 
+void handle_cqe(struct io_uring_cqe *cqe)
+{
+  Request *req = (Request *)cqe->user_data;
+  if (req->state == 5) { // accept back-off expired, -ETIME is the normal result
+    if (state.accept_stalled) {
+      state.accept_stalled = 0;
+      queue_accept(state.sock);
+    }
+    return;
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    req->buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    req->client_request = state.buffers + req->buffer_id * READ_BUFFER_SIZE;
+    state.buffers_held++;
+  }
+
+  if (req->state == 2 && cqe->res == -ENOBUFS) {
+    // The ring was empty. Wait for the next buffer given back, unless they
+    // are all back already and the ring has filled up since.
+    if (state.buffers_held > 0) {
+      free_list_push(state.reads_starved, req);
+    } else {
+      queue_read(req, req->client_fd);
+    }
+    return;
+  }
+  if (cqe->res < 0) {
+    fprintf(stderr, "Async request failed: %s for event with state %d\n",
+            strerror(-cqe->res), req->state);
+    switch (req->state) {
+      case 1: {
+        release_request(req);
+        int err = -cqe->res;
+        if (err == EMFILE || err == ENFILE || err == ENOMEM || err == ENOBUFS) {
+          stall_accept();
+        } else {
+          queue_accept(state.sock);
+        }
+      } break;
+      case 2: case 3: { queue_close(req); } break;
+      default: { release_request(req); } break;
+    }
+    return;
+  }
+
+  switch(req->state) {
+    case 1: { // accept response
+      queue_accept(state.sock); // replace consumed accept event
+      req->client_fd = cqe->res;
+      assert(req->client_fd > 0);
+      fprintf(stderr, "Accepted client %d\n", req->client_fd);
+      queue_read(req, req->client_fd);
+    } break;
+    case 2: { // read response
+      int n_bytes_read = cqe->res;
+      if (n_bytes_read == 0) { // client hung up without sending
+        release_buffer(req);
+        queue_close(req);
+        break;
+      }
+      fprintf(stderr, "Read client request with data %.*s\n", n_bytes_read,
+              req->client_request);
+
+      if (1) { // close response
+        release_buffer(req);
+        queue_close(req);
+      } else { // write, reusing the read buffer
+        Size buf_len = 8;
+        queue_write(req, req->client_request, buf_len);
+      };
+    } break;
+    case 3: { // write response
+      int n_bytes_written = cqe->res;
+      assert(n_bytes_written > 0);
+      release_buffer(req);
+      queue_close(req);
+    } break;
+    case 4: { // close
+      state.connections++;
+      release_request(req);
+    } break;
+    default: { fprintf(stderr, "unknown event\n"); }
+  }
+}
+
+// Churn check, memory must not grow with the connection count. On ^C the
+// server prints its syscalls per connection, peak Requests and max RSS:
+//   $ for i in $(seq 100000); do echo hi | socat -t1 - UNIX-CONNECT:/tmp/srv.sock; done
 int main(int argc, char **argv)
 {
-  Arena *heap = new_arena(1 << 18);
+  Arena *heap = new_arena(1 << 20);
   Str sock_path = S("/tmp/srv.sock");
 
   signal(SIGINT, sigint_handler);
 
-  int sock = initialize_socket(sock_path);
+  state.sock = initialize_socket(sock_path);
+  pools_init(heap);
 
   io_uring_queue_init(32, &state.ring, 0);
-  struct io_uring_cqe *cqe = {0};
-  queue_accept(heap, sock);
+  buffer_ring_init(heap);
+  queue_accept(state.sock);
 
+  // One io_uring_enter per iteration: it submits everything queued while
+  // handling the previous batch and waits for at least one completion.
+  // Every completion already posted is then handled before advancing the
+  // CQ head once.
   while (!state.should_close) {
-    int ret = io_uring_wait_cqe(&state.ring, &cqe);
+    int ret = io_uring_submit_and_wait(&state.ring, 1);
+    state.enter_calls++;
     if (ret < 0) {
-      perror("io_uring_wait_cqe");
+      if (ret != -EINTR) {
+        fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+      }
       continue;
     }
 
-    Request *req = (Request *)cqe->user_data;
-    if (cqe->res < 0) {
-      fprintf(stderr, "Async request failed: %s for event with state %d\n",
-              strerror(-cqe->res), req->state);
-    }
-    else {
-      switch(req->state) {
-        case 1: { // accept response
-          queue_accept(heap, sock); // replace consumed accept event
-          req->client_fd = cqe->res;
-          assert(req->client_fd > 0);
-          fprintf(stderr, "Accepted client %d\n", req->client_fd);
-          queue_read(heap, req, req->client_fd);
-        } break;
-        case 2: { // read response
-          int n_bytes_read = cqe->res;
-          assert(n_bytes_read > 0);
-          fprintf(stderr, "Read client request with data %.*s\n", n_bytes_read,
-                  req->client_request);
-
-          if (1) { // close response
-            queue_close(req);
-          } else { // write
-            Size buf_len = 8;
-            U8 *buf = new(heap, U8, buf_len); // TODO pool these buffers
-            queue_write(req, buf, buf_len);
-          };
-        } break;
-        case 3: { // write response
-          int n_bytes_written = cqe->res;
-          assert(n_bytes_written > 0);
-          queue_close(req);
-        } break;
-        case 4: { // close
-          // ok
-        } break;
-        default: { fprintf(stderr, "unknown event\n"); }
-      }
+    unsigned head;
+    unsigned seen = 0;
+    struct io_uring_cqe *cqe;
+    io_uring_for_each_cqe(&state.ring, head, cqe) {
+      handle_cqe(cqe);
+      seen++;
     }
-    io_uring_cqe_seen(&state.ring, cqe);
+    io_uring_cq_advance(&state.ring, seen);
   }
 
+  fprintf(stderr, "%llu io_uring_enter calls for %llu connections (%.2f per connection)\n",
+          (unsigned long long)state.enter_calls, (unsigned long long)state.connections,
+          state.connections ? (double)state.enter_calls / state.connections : 0.);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "peak %lld of %lld requests in use, max RSS %ld KiB\n",
+          (long long)state.requests_peak, (long long)state.max_connections, usage.ru_maxrss);
+
+  io_uring_free_buf_ring(&state.ring, state.buffer_ring, READ_BUFFERS, READ_BUFFER_GROUP);
   io_uring_queue_exit(&state.ring);
 
   return 0;